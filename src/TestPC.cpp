@@ -1,6 +1,5 @@
 #include "TestPC.h"
 #include <swal/window.h>
-#include <fstream>
 #include <dwmapi.h>
 
 namespace {
@@ -18,21 +17,35 @@ enum Interrupts {
 const TCHAR ftWndClassName[] = TEXT("TestPC");
 const uint8_t startPoint[16] = { 0xEA, 0, 0, 0x40, 0 };
 
+auto SharedImage() -> std::shared_ptr<const cpu86e::Image>
+{
+    static auto image = cpu86e::Image::Map("testpc.img");
+    return image;
+}
+
 }
 
 TestPC::TestPC() :
-    mainMemory(MainMemorySize),
-    frameBuffers(FrameBufferSize * 2),
-    backBuffer(1),
+    frameBuffers(FrameBufferSize),
     cpu(*this),
     window(MyRegisterClass(), hInstance, this)
 {
-    std::fill(frameBuffers.begin(), frameBuffers.end(), 0);
-    std::ifstream image("testpc.img", std::ios::binary);
-    if (image.fail()) {
-        throw std::runtime_error("FAIL!");
-    }
-    image.read(reinterpret_cast<char*>(mainMemory.data()), MainMemorySize);
+    using cpu86e::Memory;
+    std::fill(std::begin(romPage), std::end(romPage), 0xFF);
+    std::copy(std::begin(startPoint), std::end(startPoint), romPage + (ProgramStart & (Memory::PageSize - 1)));
+    memory.MapImage(0, SharedImage(), 0, MainMemorySize);
+    MapFrameBuffer();
+    memory.MapRom(ProgramStart & ~(Memory::PageSize - 1), romPage, Memory::PageSize);
+}
+
+void TestPC::Capture(int fd, cpu86e::FramePipeline::Format format)
+{
+    capture = std::make_unique<cpu86e::FramePipeline>(fd, format);
+}
+
+void TestPC::MapFrameBuffer()
+{
+    memory.MapRam(FrameBufferStart, frameBuffers.Back(), FrameBufferSize);
 }
 
 ATOM TestPC::MyRegisterClass()
@@ -80,13 +93,15 @@ LRESULT TestPC::WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam)
         bmih.biYPelsPerMeter = 3780;
         bmih.biClrUsed = 0;
         bmih.biClrImportant = 0;
+        auto front = frameBuffers.Acquire();
         for (int i = 0; i < 256; ++i) {
-            unsigned char* color = frameBuffers.data() + !backBuffer * FrameBufferSize + 64000 + i * 4;
+            auto color = front + 64000 + i * 4;
             bmi.palete[i].rgbBlue = color[0];
             bmi.palete[i].rgbGreen = color[1];
             bmi.palete[i].rgbRed = color[2];
         }
-        StretchDIBits(dc, 0, 0, 640, 400, 0, 0, 320, 200, frameBuffers.data() + !backBuffer * FrameBufferSize, reinterpret_cast<BITMAPINFO*>(&bmi), DIB_RGB_COLORS, SRCCOPY);
+        StretchDIBits(dc, 0, 0, 640, 400, 0, 0, 320, 200, front, reinterpret_cast<BITMAPINFO*>(&bmi), DIB_RGB_COLORS, SRCCOPY);
+        frameBuffers.Release();
         break;
     }
     case WM_CLOSE:
@@ -127,30 +142,22 @@ int TestPC::Run()
 
 void TestPC::ReadMem(cpu86e::CPUState &state, void *data, size_t size, uint32_t addr)
 {
-    auto out = static_cast<unsigned char*>(data);
-    for (;size != 0; addr = (addr + 1) & 0xFFFFF, ++out, --size) {
-        if (addr - ProgramStart < ProgramSize) {
-            *out = startPoint[addr - ProgramStart];
-        } else if (addr - FrameBufferStart < FrameBufferSize) {
-            *out = frameBuffers[backBuffer * FrameBufferSize + addr - FrameBufferStart];
-        } else if (addr < MainMemorySize) {
-            *out = mainMemory[addr];
-        } else {
-            *out = 0xFF;
-        }
-    }
+    memory.Read(data, size, addr);
 }
 
 void TestPC::WriteMem(cpu86e::CPUState &state, uint32_t addr, void *data, size_t size)
 {
-    auto in = static_cast<unsigned char*>(data);
-    for (;size != 0; addr = (addr + 1) & 0xFFFFF, ++in, --size) {
-        if (addr - FrameBufferStart < FrameBufferSize) {
-            frameBuffers[backBuffer * FrameBufferSize + addr - FrameBufferStart] = *in;
-        } else if (addr < MainMemorySize) {
-            mainMemory[addr] = *in;
-        }
-    }
+    memory.Write(addr, data, size);
+}
+
+cpu86e::HostSpan TestPC::Direct(uint32_t addr, bool write)
+{
+    return memory.Direct(addr, write);
+}
+
+uint64_t TestPC::StableUntil(uint64_t since)
+{
+    return ~uint64_t(0);
 }
 
 uint8_t TestPC::ReadIOByte(uint32_t addr)
@@ -170,7 +177,11 @@ void TestPC::WriteIOByte(uint32_t addr, uint8_t val)
 {
     if (addr == 0 && val & 1) {
         cpu.SetINTR(cpu.NoInterrupt);
-        backBuffer = !backBuffer;
+        frameBuffers.Publish();
+        MapFrameBuffer();
+        if (capture) {
+            capture->Submit(frameBuffers.Front());
+        }
     }
 }
 
@@ -3,7 +3,11 @@
 
 #include "cpu86e/cpu.h"
 #include <swal/window.h>
+#include <cpu86e/frameexchange.h>
+#include <cpu86e/framepipeline.h>
 #include <cpu86e/iiohook.h>
+#include <cpu86e/memory.h>
+#include <memory>
 #include <vector>
 
 class TestPC : public cpu86e::IIOHook
@@ -11,6 +15,7 @@ class TestPC : public cpu86e::IIOHook
 public:
     TestPC();
     int Run();
+    void Capture(int fd, cpu86e::FramePipeline::Format format);
 
     // IIOHook interface
 public:
@@ -20,9 +25,12 @@ public:
     uint16_t ReadIOWord(uint32_t addr);
     void WriteIOByte(uint32_t addr, uint8_t val);
     void WriteIOWord(uint32_t addr, uint16_t val);
+    cpu86e::HostSpan Direct(uint32_t addr, bool write);
+    uint64_t StableUntil(uint64_t since);
 
 private:
     static ATOM MyRegisterClass();
+    void MapFrameBuffer();
 	LRESULT WndProc(HWND hWnd, UINT message, WPARAM wParam, LPARAM lParam);
 
     static constexpr
@@ -31,13 +39,14 @@ private:
     auto ProgramStart = 0xFFFF0;
     static constexpr
     auto MainMemorySize = 0xA0000;
-    std::vector<unsigned char> mainMemory;
+    cpu86e::Memory memory;
+    unsigned char romPage[cpu86e::Memory::PageSize];
     static constexpr
     auto FrameBufferStart = 0xA0000;
     static constexpr
     auto FrameBufferSize = 0x10000;
-    std::vector<unsigned char> frameBuffers;
-    int backBuffer;
+    cpu86e::FrameExchange frameBuffers;
+    std::unique_ptr<cpu86e::FramePipeline> capture;
     cpu86e::CPU cpu;
     swal::Window window;
     MSG msg;
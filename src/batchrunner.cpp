@@ -0,0 +1,87 @@
+#include "include/cpu86e/batchrunner.h"
+
+namespace cpu86e {
+
+BatchRunner::Instance::Instance(std::unique_ptr<IIOHook> hook, const CPUState& state, long long budget) :
+    hook(std::move(hook)),
+    cpu(state, *this->hook),
+    budget(budget),
+    steps(0),
+    status(Pending)
+{}
+
+BatchRunner::BatchRunner(unsigned threads) :
+    pool(threads)
+{}
+
+auto BatchRunner::Add(std::unique_ptr<IIOHook> hook, long long budget) -> std::size_t
+{
+    return Add(std::move(hook), CPU::InitState(), budget);
+}
+
+auto BatchRunner::Add(std::unique_ptr<IIOHook> hook, const CPUState& state, long long budget) -> std::size_t
+{
+    instances.push_back(std::make_unique<Instance>(std::move(hook), state, budget));
+    return instances.size() - 1;
+}
+
+void BatchRunner::Run(int slice, Completion onComplete)
+{
+    for (std::size_t id = 0; id < instances.size(); ++id) {
+        if (instances[id]->status != Pending) {
+            continue;
+        }
+        pool.Submit([this, id, slice, &onComplete]{
+            RunSlice(id, slice, onComplete);
+        });
+    }
+    pool.Wait();
+}
+
+auto BatchRunner::Get(std::size_t id) -> Instance&
+{
+    return *instances[id];
+}
+
+auto BatchRunner::Count() const -> std::size_t
+{
+    return instances.size();
+}
+
+void BatchRunner::Clear()
+{
+    instances.clear();
+}
+
+void BatchRunner::RunSlice(std::size_t id, int slice, const Completion& onComplete)
+{
+    auto& instance = *instances[id];
+    auto steps = slice;
+    if (instance.budget != -1 && instance.budget - instance.steps < steps) {
+        steps = int(instance.budget - instance.steps);
+    }
+    try {
+        auto start = instance.cpu.Instructions();
+        if (instance.cpu.Run(steps)) {
+            instance.status = Halted;
+        }
+        instance.steps += static_cast<long long>(instance.cpu.Instructions() - start);
+        if (instance.status == Pending && instance.budget != -1 && instance.steps >= instance.budget) {
+            instance.status = Exhausted;
+        }
+    } catch (...) {
+        instance.error = std::current_exception();
+        instance.status = Failed;
+    }
+    if (instance.status == Pending) {
+        pool.Submit([this, id, slice, &onComplete]{
+            RunSlice(id, slice, onComplete);
+        });
+        return;
+    }
+    if (onComplete) {
+        onComplete(id, instance);
+    }
+}
+
+} // namespace x86emu
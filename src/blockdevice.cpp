@@ -0,0 +1,341 @@
+#include "include/cpu86e/blockdevice.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace cpu86e {
+
+namespace {
+
+constexpr RegVal CarryFlag = 1;
+
+enum DiskStatus {
+    DiskOk = 0x00,
+    DiskBadCommand = 0x01,
+    DiskNotFound = 0x04
+};
+
+auto DefaultGeometry(uint32_t sectors) -> BlockDevice::Chs
+{
+    switch (sectors) {
+    case 720:
+        return { 40, 2, 9 };
+    case 1440:
+        return { 80, 2, 9 };
+    case 2400:
+        return { 80, 2, 15 };
+    case 2880:
+        return { 80, 2, 18 };
+    }
+    constexpr uint32_t heads = 16;
+    constexpr uint32_t perTrack = 63;
+    auto cylinders = std::clamp<uint32_t>((sectors + heads * perTrack - 1) / (heads * perTrack), 1, 1024);
+    return { uint16_t(cylinders), uint8_t(heads), uint8_t(perTrack) };
+}
+
+}
+
+BlockDevice::BlockDevice(std::shared_ptr<const Image> image, uint32_t readAhead) :
+    image(std::move(image)),
+    sectors(uint32_t(std::min<size_t>(this->image->Size() / SectorSize, ~uint32_t(0)))),
+    chs(DefaultGeometry(sectors)),
+    lba(0),
+    count(0),
+    command(0),
+    status(Ready),
+    remaining(0),
+    pos(0),
+    buffer{},
+    readAhead(readAhead),
+    aheadFirst(0),
+    aheadEnd(0),
+    pendingFirst(0),
+    pendingEnd(0),
+    stop(false),
+    prefetched(0)
+{
+    worker = std::thread(&BlockDevice::WorkerMain, this);
+}
+
+BlockDevice::~BlockDevice()
+{
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+auto BlockDevice::Sectors() const -> uint32_t
+{
+    return sectors;
+}
+
+auto BlockDevice::Geometry() const -> Chs
+{
+    return chs;
+}
+
+void BlockDevice::SetGeometry(Chs chs)
+{
+    this->chs = chs;
+}
+
+void BlockDevice::Read(uint32_t lba, void *data, uint32_t count)
+{
+    if (!Valid(lba, count)) {
+        throw std::runtime_error("Sector out of range");
+    }
+    auto out = static_cast<uint8_t*>(data);
+    for (uint32_t i = 0; i < count; ++i) {
+        std::memcpy(out + i * SectorSize, Sector(lba + i), SectorSize);
+    }
+    ReadAhead(lba + count);
+}
+
+void BlockDevice::Write(uint32_t lba, const void *data, uint32_t count)
+{
+    if (!Valid(lba, count)) {
+        throw std::runtime_error("Sector out of range");
+    }
+    auto in = static_cast<const uint8_t*>(data);
+    for (uint32_t i = 0; i < count; ++i) {
+        auto& sector = overlay[lba + i];
+        if (!sector) {
+            sector = std::make_unique<uint8_t[]>(SectorSize);
+        }
+        std::memcpy(sector.get(), in + i * SectorSize, SectorSize);
+    }
+}
+
+auto BlockDevice::Overlay() const -> std::size_t
+{
+    return overlay.size();
+}
+
+void BlockDevice::Discard()
+{
+    overlay.clear();
+}
+
+auto BlockDevice::Prefetched() const -> uint64_t
+{
+    return prefetched.load(std::memory_order_relaxed);
+}
+
+auto BlockDevice::ReadPort(uint32_t port) -> uint8_t
+{
+    switch (port) {
+    case Data: {
+        if (command != ReadSectors || !(status & Request)) {
+            return 0xFF;
+        }
+        auto val = buffer[pos++];
+        if (pos == SectorSize) {
+            ++lba;
+            if (--remaining) {
+                Load();
+            } else {
+                status = Ready;
+            }
+        }
+        return val;
+    }
+    case Count:
+        return count;
+    case Lba0:
+    case Lba1:
+    case Lba2:
+    case Lba3:
+        return uint8_t(lba >> (port - Lba0) * 8);
+    case Command:
+        return status;
+    }
+    return 0xFF;
+}
+
+void BlockDevice::WritePort(uint32_t port, uint8_t val)
+{
+    switch (port) {
+    case Data:
+        if (command != WriteSectors || !(status & Request)) {
+            break;
+        }
+        buffer[pos++] = val;
+        if (pos == SectorSize) {
+            Write(lba++, buffer, 1);
+            pos = 0;
+            if (!--remaining) {
+                status = Ready;
+            }
+        }
+        break;
+    case Count:
+        count = val;
+        break;
+    case Lba0:
+    case Lba1:
+    case Lba2:
+    case Lba3: {
+        auto shift = (port - Lba0) * 8;
+        lba = (lba & ~(0xFFu << shift)) | uint32_t(val) << shift;
+        break;
+    }
+    case Command:
+        command = val;
+        remaining = count ? count : 256;
+        pos = 0;
+        if ((val != ReadSectors && val != WriteSectors) || !Valid(lba, remaining)) {
+            status = Ready | Error;
+            break;
+        }
+        status = Ready | Request;
+        if (val == ReadSectors) {
+            Load();
+        }
+        break;
+    }
+}
+
+void BlockDevice::Attach(CPU &cpu, uint8_t drive, uint8_t vector)
+{
+    cpu.SetHandler(vector, [this, drive](CPU& cpu, int) {
+        return Interrupt(cpu, drive);
+    });
+}
+
+auto BlockDevice::Valid(uint32_t lba, uint32_t count) const -> bool
+{
+    return lba <= sectors && count <= sectors - lba;
+}
+
+auto BlockDevice::Sector(uint32_t lba) const -> const uint8_t*
+{
+    auto found = overlay.find(lba);
+    if (found != overlay.end()) {
+        return found->second.get();
+    }
+    return image->Data() + size_t(lba) * SectorSize;
+}
+
+void BlockDevice::ReadAhead(uint32_t first)
+{
+    if (readAhead == 0 || first >= sectors) {
+        return;
+    }
+    auto end = uint32_t(std::min<uint64_t>(sectors, uint64_t(first) + readAhead));
+    if (first >= aheadFirst && uint64_t(first) + readAhead / 2 <= aheadEnd) {
+        return;
+    }
+    auto start = first >= aheadFirst && first <= aheadEnd ? aheadEnd : first;
+    aheadFirst = first;
+    aheadEnd = end;
+    if (start >= end) {
+        return;
+    }
+    {
+        std::lock_guard lock(mutex);
+        pendingFirst = start;
+        pendingEnd = end;
+    }
+    wake.notify_one();
+}
+
+auto BlockDevice::Interrupt(CPU &cpu, uint8_t drive) -> bool
+{
+    auto& state = cpu.State();
+    auto& regs = state.gpr;
+    if (uint8_t(regs[DX]) != drive) {
+        return false;
+    }
+    auto function = regs[AX] >> 8;
+    auto result = DiskOk;
+    switch (function) {
+    case 0x00:
+        break;
+    case 0x02:
+    case 0x03: {
+        uint32_t n = uint8_t(regs[AX]);
+        uint32_t cylinder = regs[CX] >> 8 | (regs[CX] & 0xC0) << 2;
+        uint32_t head = regs[DX] >> 8;
+        uint32_t sector = regs[CX] & 0x3F;
+        if (sector == 0 || sector > chs.sectors || head >= chs.heads || cylinder >= chs.cylinders) {
+            result = DiskNotFound;
+            break;
+        }
+        auto first = (cylinder * chs.heads + head) * chs.sectors + sector - 1;
+        if (n == 0 || !Valid(first, n)) {
+            result = DiskNotFound;
+            break;
+        }
+        auto addr = state.sregs[ES] * 0x10u + regs[BX];
+        for (uint32_t i = 0; i < n; ++i, addr += SectorSize) {
+            if (function == 0x02) {
+                cpu.Write(addr, Sector(first + i), SectorSize);
+            } else {
+                uint8_t data[SectorSize];
+                cpu.Read(addr, data, SectorSize);
+                Write(first + i, data, 1);
+            }
+        }
+        if (function == 0x02) {
+            ReadAhead(first + n);
+        }
+        break;
+    }
+    case 0x08: {
+        auto cylinder = chs.cylinders - 1;
+        regs[CX] = RegVal((cylinder & 0xFF) << 8 | (cylinder >> 2 & 0xC0) | chs.sectors);
+        regs[DX] = RegVal((chs.heads - 1) << 8 | 1);
+        regs[BX] &= 0xFF00;
+        break;
+    }
+    default:
+        result = DiskBadCommand;
+        break;
+    }
+    regs[AX] = RegVal(result << 8 | (function == 0x08 ? 0 : regs[AX] & 0xFF));
+    if (result == DiskOk) {
+        state.flags &= ~CarryFlag;
+    } else {
+        state.flags |= CarryFlag;
+    }
+    return true;
+}
+
+void BlockDevice::Load()
+{
+    std::memcpy(buffer, Sector(lba), SectorSize);
+    pos = 0;
+    ReadAhead(lba + 1);
+}
+
+void BlockDevice::WorkerMain()
+{
+    while (true) {
+        uint32_t first;
+        uint32_t end;
+        {
+            std::unique_lock lock(mutex);
+            wake.wait(lock, [this] { return pendingFirst < pendingEnd || stop; });
+            if (stop) {
+                return;
+            }
+            first = pendingFirst;
+            end = pendingEnd;
+            pendingFirst = pendingEnd = 0;
+        }
+        auto data = image->Data();
+        auto begin = size_t(first) * SectorSize;
+        auto limit = size_t(end) * SectorSize;
+        [[maybe_unused]] volatile uint8_t sink;
+        for (auto offset = begin; offset < limit; offset += Memory::PageSize) {
+            sink = data[offset];
+        }
+        sink = data[limit - 1];
+        prefetched.fetch_add(end - first, std::memory_order_relaxed);
+    }
+}
+
+} // namespace x86emu
@@ -0,0 +1,154 @@
+#include "include/cpu86e/bootcache.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+namespace cpu86e {
+
+namespace {
+
+const char bootCacheMagic[4] = { 'C', '8', '6', 'B' };
+
+auto HashBytes(uint64_t hash, const uint8_t* data, size_t size) -> uint64_t
+{
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ data[i]) * 0x100000001B3;
+    }
+    return hash;
+}
+
+auto HashPage(const uint8_t* data) -> uint64_t
+{
+    return HashBytes(0xCBF29CE484222325, data, Memory::PageSize);
+}
+
+template <class T>
+void Put(std::vector<uint8_t>& out, const T* data, size_t count = 1)
+{
+    auto bytes = reinterpret_cast<const uint8_t*>(data);
+    out.insert(out.end(), bytes, bytes + sizeof(T) * count);
+}
+
+template <class T>
+bool Get(const std::vector<uint8_t>& in, size_t& pos, T* data, size_t count = 1)
+{
+    auto size = sizeof(T) * count;
+    if (in.size() - pos < size) {
+        return false;
+    }
+    std::memcpy(data, in.data() + pos, size);
+    pos += size;
+    return true;
+}
+
+}
+
+auto BootCache::Hash(const Memory &memory) -> Key
+{
+    Key key(Memory::PageCount);
+    uint8_t page[Memory::PageSize];
+    for (uint32_t index = 0; index < Memory::PageCount; ++index) {
+        memory.Read(page, sizeof(page), index << Memory::PageBits);
+        key[index] = HashPage(page);
+    }
+    return key;
+}
+
+auto BootCache::HashDevice(const void *data, size_t size, uint64_t device) -> uint64_t
+{
+    return HashBytes(device ? device : 0xCBF29CE484222325, static_cast<const uint8_t*>(data), size);
+}
+
+void BootCache::Save(const char *path, const Key &key, const CPU &cpu, const Memory &memory, uint64_t device)
+{
+    if (key.size() != Memory::PageCount) {
+        throw std::runtime_error("Invalid boot cache key");
+    }
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> records;
+    uint32_t count = 0;
+    uint8_t page[Memory::PageSize];
+    for (uint32_t index = 0; index < Memory::PageCount; ++index) {
+        memory.Read(page, sizeof(page), index << Memory::PageBits);
+        if (HashPage(page) == key[index]) {
+            continue;
+        }
+        Put(records, &index);
+        Put(records, page, sizeof(page));
+        ++count;
+    }
+    Put(out, bootCacheMagic, sizeof(bootCacheMagic));
+    Put(out, &device);
+    Put(out, key.data(), key.size());
+    Put(out, &cpu.State());
+    Put(out, &count);
+    out.insert(out.end(), records.begin(), records.end());
+    auto hash = HashBytes(0xCBF29CE484222325, out.data(), out.size());
+    Put(out, &hash);
+    auto temp = std::string(path) + ".tmp";
+    {
+        std::ofstream file(temp, std::ios::binary);
+        file.write(reinterpret_cast<const char*>(out.data()), out.size());
+        file.close();
+        if (file.fail()) {
+            std::filesystem::remove(temp);
+            throw std::runtime_error("Can't write boot cache");
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temp, path, error);
+    if (error) {
+        std::filesystem::remove(temp, error);
+        throw std::runtime_error("Can't write boot cache");
+    }
+}
+
+bool BootCache::Load(const char *path, CPU &cpu, Memory &memory, uint64_t device)
+{
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> in((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    uint64_t hash;
+    if (file.bad() || in.size() < sizeof(hash)) {
+        return false;
+    }
+    std::memcpy(&hash, in.data() + in.size() - sizeof(hash), sizeof(hash));
+    in.resize(in.size() - sizeof(hash));
+    if (HashBytes(0xCBF29CE484222325, in.data(), in.size()) != hash) {
+        return false;
+    }
+    size_t pos = 0;
+    char magic[sizeof(bootCacheMagic)];
+    uint64_t saved;
+    Key key(Memory::PageCount);
+    CPUState state;
+    uint32_t count;
+    if (!Get(in, pos, magic, sizeof(magic)) || !Get(in, pos, &saved) || saved != device ||
+        !Get(in, pos, key.data(), key.size()) ||
+        !Get(in, pos, &state) || !Get(in, pos, &count)) {
+        return false;
+    }
+    auto record = sizeof(uint32_t) + Memory::PageSize;
+    if (std::memcmp(magic, bootCacheMagic, sizeof(magic)) != 0 || count > Memory::PageCount ||
+        in.size() - pos != count * record || key != Hash(memory)) {
+        return false;
+    }
+    for (auto at = pos; at < in.size(); at += record) {
+        uint32_t index;
+        std::memcpy(&index, in.data() + at, sizeof(index));
+        if (index >= Memory::PageCount) {
+            return false;
+        }
+    }
+    for (; pos < in.size(); pos += record) {
+        uint32_t index;
+        std::memcpy(&index, in.data() + pos, sizeof(index));
+        memory.Write(index << Memory::PageBits, in.data() + pos + sizeof(index), Memory::PageSize);
+    }
+    cpu.LoadState(state);
+    return true;
+}
+
+} // namespace x86emu
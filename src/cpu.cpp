@@ -1,6 +1,15 @@
 #include "include/cpu86e/cpu.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
 #include <cstring>
 #include <exception>
+#include <stdexcept>
+#include <vector>
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 namespace cpu86e {
 
@@ -19,6 +28,9 @@ enum DoOpcodeResult {
     Halt,
 };
 
+constexpr uint32_t AddressMask = 0xFFFFF;
+constexpr uint32_t FetchPage = 0x1000;
+
 char8_t map[] = {
     1, 1, 1, 1, 0, 0, 0, 0,
     1, 1, 1, 1, 0, 0, 0, 0,
@@ -125,7 +137,7 @@ public:
         exception(e)
     {}
 
-    const char *what() const
+    const char *what() const noexcept
     {
         return "CPU Exception";
     }
@@ -148,11 +160,31 @@ CPU::CPU(IIOHook& hook) :
 CPU::CPU(const CPUState &initState, IIOHook& hook) :
     state(initState),
     hook(&hook),
+    fetch(window),
+    windowAddr(0),
+    windowSize(0),
+    ivt(nullptr),
+    ivtCached(false),
+    budget(1),
+    retired(1),
+    writes(0),
+    spinWrites(0),
+    spinTarget(~0u),
+    spinAt(0),
+    spinState{},
     oldflags(0),
     nmi(0),
     halt(0),
-    intr(NoInterrupt)
-{}
+    intr(NoInterrupt),
+    coverage(nullptr),
+    coverageMask(0),
+    prevLocation(0),
+    instructions(0),
+    hypercalls(false)
+{
+    LoadBases();
+    FlushFetch();
+}
 
 void CPU::StoreState(CPUState &initState) const
 {
@@ -162,7 +194,10 @@ void CPU::StoreState(CPUState &initState) const
 void CPU::LoadState(const CPUState &initState)
 {
     oldflags = 0;
+    spinTarget = ~0u;
     state = initState;
+    LoadBases();
+    FlushFetch();
 }
 
 auto CPU::State() -> CPUState&
@@ -178,6 +213,12 @@ auto CPU::State() const -> const CPUState&
 void CPU::SetHook(IIOHook *argHook)
 {
     hook = argHook;
+    FlushFetch();
+}
+
+auto CPU::Hook() const -> IIOHook*
+{
+    return hook;
 }
 
 struct CPU::Prefixes {
@@ -189,12 +230,15 @@ struct CPU::Prefixes {
 
 int CPU::Run(int steps)
 {
+    LoadBases();
+    FlushFetch();
     while (true) {
+        budget = steps == -1 ? MaxBulk : steps;
         auto r = DoStep();
         if (r == Halt) {
             return 1;
         }
-        if (steps != -1 && --steps <= 0) {
+        if (steps != -1 && (steps -= retired) <= 0) {
             return 0;
         }
     }
@@ -202,6 +246,9 @@ int CPU::Run(int steps)
 
 void CPU::Step()
 {
+    LoadBases();
+    FlushFetch();
+    budget = 1;
     DoStep();
 }
 
@@ -361,6 +408,12 @@ struct CPU::Calc {
 
 struct CPU::Operations {
 
+    static constexpr auto hostHigh = int(std::endian::native == std::endian::big);
+    static constexpr uint8_t byteRegs[8] = {
+        0 + hostHigh, 2 + hostHigh, 4 + hostHigh, 6 + hostHigh,
+        1 - hostHigh, 3 - hostHigh, 5 - hostHigh, 7 - hostHigh
+    };
+
     struct ModRM {
         enum RMType {
             Addr,
@@ -372,63 +425,59 @@ struct CPU::Operations {
         uint8_t reg;
     };
 
+    struct ModRMDecode {
+        uint8_t base;
+        uint8_t index;
+        uint8_t disp;
+        uint8_t type;
+        RegVal baseMask;
+        RegVal indexMask;
+    };
+
+    static constexpr auto modRMTable = [] {
+        constexpr uint8_t bases[8] = { BX, BX, BP, BP, SI, DI, BP, BX };
+        constexpr uint8_t indexes[8] = { SI, DI, SI, DI, 0, 0, 0, 0 };
+        std::array<ModRMDecode, 256> table{};
+        for (int i = 0; i < 256; ++i) {
+            auto mod = i >> 6;
+            auto rm = i & 7;
+            auto& entry = table[i];
+            if (mod == 3) {
+                entry.base = uint8_t(rm);
+                entry.type = ModRM::Reg;
+                continue;
+            }
+            auto direct = mod == 0 && rm == 6;
+            entry.base = bases[rm];
+            entry.index = indexes[rm];
+            entry.disp = uint8_t(direct ? 2 : mod);
+            entry.baseMask = direct ? 0 : 0xFFFF;
+            entry.indexMask = rm < 4 ? 0xFFFF : 0;
+            entry.type = (bases[rm] == BP && !direct) ? ModRM::AddrSS : ModRM::Addr;
+        }
+        return table;
+    }();
+
     static ModRM GetModRM(CPU* cpu)
     {
-        auto modRM = cpu->ReadByte(CS, cpu->state.ip++);
+        auto modRM = cpu->FetchByte(cpu->state.ip++);
+        auto& entry = modRMTable[modRM];
         ModRM result;
         result.reg = (modRM >> 3) & 7;
-        if ((modRM & 0xC0) == 0xC0) {
-            result.addr = modRM & 7;
-            result.type = result.Reg;
+        result.type = entry.type;
+        if (entry.type == ModRM::Reg) {
+            result.addr = entry.base;
             return result;
         }
-        result.type = result.Addr;
-        auto regs = cpu->state.gpr;
-        switch (modRM & 7) {
-        case 0:
-            result.addr = regs[BX] + regs[SI];
-            break;
-        case 1:
-            result.addr = regs[BX] + regs[DI];
-            break;
-        case 2:
-            result.type = result.AddrSS;
-            result.addr = regs[BP] + regs[SI];
-            break;
-        case 3:
-            result.type = result.AddrSS;
-            result.addr = regs[BP] + regs[DI];
-            break;
-        case 4:
-            result.addr = regs[SI];
-            break;
-        case 5:
-            result.addr = regs[DI];
-            break;
-        case 6:
-            if ((modRM & 0xC0) == 0) {
-                result.addr = 0;
-                modRM |= 0x80;
-                break;
-            }
-            result.type = result.AddrSS;
-            result.addr = regs[BP];
-            break;
-        case 7:
-            result.addr = regs[BX];
-            break;
-        }
-        switch (modRM & 0xC0) {
-        case 0:
-            break;
-        case 0x40:
-            result.addr += cpu->ReadByte(CS, cpu->state.ip++);
-            break;
-        case 0x80:
-            result.addr += cpu->ReadWord(CS, cpu->state.ip);
-            cpu->state.ip += 2;
-            break;
+        RegVal disp = 0;
+        if (entry.disp == 1) {
+            disp = cpu->FetchByte(cpu->state.ip);
+        } else if (entry.disp == 2) {
+            disp = cpu->FetchWord(cpu->state.ip);
         }
+        cpu->state.ip += entry.disp;
+        auto regs = cpu->state.gpr;
+        result.addr = (regs[entry.base] & entry.baseMask) + (regs[entry.index] & entry.indexMask) + disp;
         return result;
     }
 
@@ -447,10 +496,10 @@ struct CPU::Operations {
 
     static auto ReadReg(CPU* cpu, Register reg, int logSz) -> RegVal
     {
-        auto regs = cpu->state.gpr;
-        auto rh = (logSz == 0) * (reg & 4);
-        auto shift = 2 * rh;
-        return ZeroExtend(regs[reg ^ rh] >> shift, logSz);
+        if (logSz == 0) {
+            return reinterpret_cast<const uint8_t*>(cpu->state.gpr)[byteRegs[reg]];
+        }
+        return cpu->state.gpr[reg];
     }
 
     static void WriteReg(CPU* cpu, int reg, int logSz, RegVal val)
@@ -460,13 +509,11 @@ struct CPU::Operations {
 
     static void WriteReg(CPU* cpu, Register reg, int logSz, RegVal val)
     {
-        auto regs = cpu->state.gpr;
-        auto mask = (0x100 << ((8 << logSz) - 8)) - 1;
-        auto rh = (logSz == 0) * (reg & 4);
-        auto shift = 2 * rh;
-        mask <<= shift;
-        auto& r = regs[reg ^ rh];
-        r ^= (r & mask) ^ ((val << shift) & mask);
+        if (logSz == 0) {
+            reinterpret_cast<uint8_t*>(cpu->state.gpr)[byteRegs[reg]] = uint8_t(val);
+            return;
+        }
+        cpu->state.gpr[reg] = val;
     }
 
     static void ReadRM(CPU* cpu, Prefixes prefixes, ModRM modrm, Calc& calc)
@@ -544,7 +591,7 @@ struct CPU::Operations {
         auto& flags = cpu->state.flags;
         auto& ip = cpu->state.ip;
         Calc calc(op & 1);
-        calc.n[1] = cpu->ReadMem(CS, ip, (op & 3) == 1);
+        calc.n[1] = cpu->Fetch(ip, (op & 3) == 1);
         ip += 1 << ((op & 3) == 1);
         calc.n[0] = ReadRM(cpu, prefixes, modRM, calc.logSz);
         auto oprm = Calc::Op(modRM.reg);
@@ -558,16 +605,23 @@ struct CPU::Operations {
 
     static void PushVal(CPU* cpu, int logSz, RegVal val)
     {
-        cpu->WriteMem(SS, cpu->state.gpr[SP] -= 1 << logSz, logSz, val);
+        cpu->WriteMem(SS, cpu->state.gpr[SP] -= 1 << logSz, logSz, val, IIOHook::Stack);
     }
 
     static auto PopVal(CPU* cpu, int logSz) -> RegVal
     {
-        RegVal result = cpu->ReadMem(SS, cpu->state.gpr[SP], logSz);
+        RegVal result = cpu->ReadMem(SS, cpu->state.gpr[SP], logSz, IIOHook::Stack);
         cpu->state.gpr[SP] += 1 << logSz;
         return result;
     }
 
+    static void Branch(CPU* cpu)
+    {
+        if (cpu->coverage) {
+            cpu->Edge();
+        }
+    }
+
     static int PushSReg(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         PushVal(cpu, 1, cpu->state.sregs[(op >> 3) & 3]);
@@ -576,7 +630,7 @@ struct CPU::Operations {
 
     static int PopSReg(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
-        cpu->state.sregs[(op >> 3) & 3] = PopVal(cpu, 1);
+        cpu->LoadSeg((op >> 3) & 3, PopVal(cpu, 1));
         return Normal;
     }
 
@@ -629,7 +683,7 @@ struct CPU::Operations {
         auto& ip = cpu->state.ip;
         auto& ax = cpu->state.gpr[AX];
         auto& flags = cpu->state.flags;
-        auto imm = cpu->ReadByte(CS, ip);
+        auto imm = cpu->FetchByte(ip);
         if (imm == 0) {
             throw CPUException(CPUException::DE);
         }
@@ -647,7 +701,7 @@ struct CPU::Operations {
         auto& ip = cpu->state.ip;
         auto& ax = cpu->state.gpr[AX];
         auto& flags = cpu->state.flags;
-        auto imm = cpu->ReadByte(CS, ip);
+        auto imm = cpu->FetchByte(ip);
         auto t = ax >> 8;
         ax = (ax + t * imm) & 0xFF;
         Calc calc(0);
@@ -726,7 +780,7 @@ struct CPU::Operations {
     {
         auto& ip = cpu->state.ip;
         auto& flags = cpu->state.flags;
-        auto off = SignExtend(cpu->ReadByte(CS, ip++), 0);
+        auto off = SignExtend(cpu->FetchByte(ip++), 0);
         bool cond;
         switch ((op >> 1) & 0x7) {
         case 0:
@@ -756,6 +810,12 @@ struct CPU::Operations {
         }
         cond = cond ^ (op & 1);
         ip += off * cond;
+        if (cond) {
+            Branch(cpu);
+            if (off >= 0x8000) {
+                cpu->Spin();
+            }
+        }
         return Normal;
     }
 
@@ -825,7 +885,7 @@ struct CPU::Operations {
         auto& ip = cpu->state.ip;
         ModRM modRM = GetModRM(cpu);
         int logSz = op & 1;
-        auto temp = cpu->ReadMem(CS, ip, logSz);
+        auto temp = cpu->Fetch(ip, logSz);
         ip += 1 << logSz;
         WriteRM(cpu, prefixes, modRM, logSz, temp);
         return Normal;
@@ -848,7 +908,6 @@ struct CPU::Operations {
 
     static int MovSregR(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
-        auto sreg = cpu->state.sregs;
         ModRM modRM = GetModRM(cpu);
         if (modRM.reg == CS) {
             throw CPUException(CPUException::UD);
@@ -861,7 +920,7 @@ struct CPU::Operations {
             auto sreg = GetSeg(prefixes, modRM.type);
             temp = cpu->ReadMem(sreg, modRM.addr, logSz);
         }
-        sreg[modRM.reg] = temp;
+        cpu->LoadSeg(modRM.reg, temp);
         return Normal;
     }
 
@@ -925,16 +984,16 @@ struct CPU::Operations {
     static int CallF(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto& cs = cpu->state.sregs[CS];
         auto logSz = 1;
-        auto off = cpu->ReadMem(CS, ip, logSz);
+        auto off = cpu->Fetch(ip, logSz);
         ip += 1 << logSz;
-        auto seg = cpu->ReadWord(CS, ip);
+        auto seg = cpu->FetchWord(ip);
         ip += 2;
-        PushVal(cpu, 1, cs);
+        PushVal(cpu, 1, cpu->state.sregs[CS]);
         PushVal(cpu, logSz, ip);
-        cs = seg;
+        cpu->LoadSeg(CS, seg);
         ip = off;
+        Branch(cpu);
         return Normal;
     }
 
@@ -976,7 +1035,7 @@ struct CPU::Operations {
     {
         auto& ip = cpu->state.ip;
         int logSz = op & 1;
-        auto addr = cpu->ReadMem(CS, ip, 1); // TODO: Address size
+        auto addr = cpu->Fetch(ip, 1); // TODO: Address size
         ip += 1 << logSz;
         auto seg = GetSeg(prefixes);
         auto temp = cpu->ReadMem(seg, addr, logSz);
@@ -989,7 +1048,7 @@ struct CPU::Operations {
         auto& ax = cpu->state.gpr[AX];
         auto& ip = cpu->state.ip;
         int logSz = op & 1;
-        auto addr = cpu->ReadMem(CS, ip, 1);
+        auto addr = cpu->Fetch(ip, 1);
         ip += 1 << logSz;
         auto seg = GetSeg(prefixes);
         cpu->WriteMem(seg, addr, logSz, ax);
@@ -1006,8 +1065,15 @@ struct CPU::Operations {
         auto& flags = cpu->state.flags;
         int logSz = op & 1;
         auto seg = GetSeg(prefixes);
-        auto temp = cpu->ReadMem(seg, regs[SI], logSz);
-        cpu->WriteMem(ES, regs[DI], logSz, temp);
+        if (prefixes.grp1 == PF3) {
+            if (auto n = cpu->BulkCopy(seg, logSz, counter)) {
+                counter -= n;
+                WriteReg(cpu, CX, 1, counter);
+                return (counter != 0) * Repeat;
+            }
+        }
+        auto temp = cpu->ReadMem(seg, regs[SI], logSz, IIOHook::String);
+        cpu->WriteMem(ES, regs[DI], logSz, temp, IIOHook::String);
         int size = (1 << logSz) * (2 * !(flags & DF) - 1);
         regs[SI] += size;
         regs[DI] += size;
@@ -1030,8 +1096,8 @@ struct CPU::Operations {
         int logSz = op & 1;
         auto seg = GetSeg(prefixes);
         Calc calc(logSz);
-        calc.n[0] = cpu->ReadMem(seg, regs[SI], logSz);
-        calc.n[1] = cpu->ReadMem(ES, regs[DI], logSz);
+        calc.n[0] = cpu->ReadMem(seg, regs[SI], logSz, IIOHook::String);
+        calc.n[1] = cpu->ReadMem(ES, regs[DI], logSz, IIOHook::String);
         calc.DoOp(calc.Cmp);
         flags = calc.GetFlags(flags);
         int size = (1 << logSz) * (2 * !(flags & DF) - 1);
@@ -1058,7 +1124,14 @@ struct CPU::Operations {
         auto& regs = cpu->state.gpr;
         auto& flags = cpu->state.flags;
         int logSz = op & 1;
-        cpu->WriteMem(ES, regs[DI], logSz, regs[AX]);
+        if (prefixes.grp1 == PF3) {
+            if (auto n = cpu->BulkFill(logSz, counter)) {
+                counter -= n;
+                WriteReg(cpu, CX, 1, counter);
+                return (counter != 0) * Repeat;
+            }
+        }
+        cpu->WriteMem(ES, regs[DI], logSz, regs[AX], IIOHook::String);
         int size = (1 << logSz) * (2 * !(flags & DF) - 1);
         regs[DI] += size;
         if (prefixes.grp1 == PF3) {
@@ -1079,7 +1152,7 @@ struct CPU::Operations {
         auto& flags = cpu->state.flags;
         int logSz = op & 1;
         auto seg = GetSeg(prefixes);
-        auto temp = cpu->ReadMem(seg, regs[SI], logSz);
+        auto temp = cpu->ReadMem(seg, regs[SI], logSz, IIOHook::String);
         WriteReg(cpu, AX, logSz, temp);
         int size = (1 << logSz) * (2 * !(flags & DF) - 1);
         regs[SI] += size;
@@ -1102,7 +1175,7 @@ struct CPU::Operations {
         int logSz = op & 1;
         Calc calc(logSz);
         calc.n[0] = regs[AX];
-        calc.n[1] = cpu->ReadMem(ES, regs[DI], logSz);
+        calc.n[1] = cpu->ReadMem(ES, regs[DI], logSz, IIOHook::String);
         calc.DoOp(calc.Cmp);
         flags = calc.GetFlags(flags);
         int size = (1 << logSz) * (2 * !(flags & DF) - 1);
@@ -1123,7 +1196,7 @@ struct CPU::Operations {
     {
         int logSz = !!(op & 8);
         auto& ip = cpu->state.ip;
-        RegVal temp = cpu->ReadMem(CS, ip, logSz);
+        RegVal temp = cpu->Fetch(ip, logSz);
         ip += 1 << logSz;
         WriteReg(cpu, op & 7, logSz, temp);
         return Normal;
@@ -1135,7 +1208,7 @@ struct CPU::Operations {
         auto& flags = cpu->state.flags;
         ModRM modrm = GetModRM(cpu);
         Calc calc(op & 1);
-        calc.n[1] = cpu->ReadMem(CS, ip, 0);
+        calc.n[1] = cpu->Fetch(ip, 0);
         ip += 1;
         calc.n[0] = ReadRM(cpu, prefixes, modrm, calc.logSz);
         calc.DoOp2(Calc::Op2(modrm.reg), cpu->state.flags & CF);
@@ -1185,7 +1258,7 @@ struct CPU::Operations {
     static int RetI(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto imm = cpu->ReadWord(CS, ip);
+        auto imm = cpu->FetchWord(ip);
         auto addr = PopVal(cpu, 1);
         cpu->state.gpr[SP] += imm;
         ip = addr;
@@ -1200,7 +1273,7 @@ struct CPU::Operations {
         }
         auto ptr = ReadRM(cpu, prefixes, modrm, 1);
         modrm.addr += 2;
-        cpu->state.sregs[(op & 1) * 3] = ReadRM(cpu, prefixes, modrm, 1);
+        cpu->LoadSeg((op & 1) * 3, ReadRM(cpu, prefixes, modrm, 1));
         WriteReg(cpu, modrm.reg, 1, ptr);
         return Normal;
     }
@@ -1208,20 +1281,18 @@ struct CPU::Operations {
     static int RetF(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto& cs = cpu->state.sregs[CS];
         ip = PopVal(cpu, 1);
-        cs = PopVal(cpu, 1);
+        cpu->LoadSeg(CS, PopVal(cpu, 1));
         return Normal;
     }
 
     static int RetFI(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto& cs = cpu->state.sregs[CS];
-        auto imm = cpu->ReadWord(CS, ip);
+        auto imm = cpu->FetchWord(ip);
         cpu->state.gpr[SP] += imm;
         ip = PopVal(cpu, 1);
-        cs = PopVal(cpu, 1);
+        cpu->LoadSeg(CS, PopVal(cpu, 1));
         return Normal;
     }
 
@@ -1234,7 +1305,7 @@ struct CPU::Operations {
     static int Int(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto imm = cpu->ReadByte(CS, ip++);
+        auto imm = cpu->FetchByte(ip++);
         cpu->InitInterrupt(imm);
         return Normal;
     }
@@ -1250,8 +1321,20 @@ struct CPU::Operations {
     static int IRet(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& state = cpu->state;
+        auto& sp = state.gpr[SP];
+        if (sp <= 0x10000 - 6) {
+            auto span = cpu->hook->Direct(cpu->CalcAddr(SS, sp), false);
+            if (span.size >= 6) {
+                auto frame = span.data;
+                state.ip = frame[1] * 0x100 + frame[0];
+                cpu->LoadSeg(CS, frame[3] * 0x100 + frame[2]);
+                state.flags = frame[5] * 0x100 + frame[4];
+                sp += 6;
+                return Normal;
+            }
+        }
         state.ip = PopVal(cpu, 1);
-        state.sregs[CS] = PopVal(cpu, 1);
+        cpu->LoadSeg(CS, PopVal(cpu, 1));
         state.flags = PopVal(cpu, 1);
         return Normal;
     }
@@ -1269,12 +1352,13 @@ struct CPU::Operations {
     {
         auto& ip = cpu->state.ip;
         auto& flags = cpu->state.flags;
-        auto off = SignExtend(cpu->ReadByte(CS, ip++), 0);
+        auto off = SignExtend(cpu->FetchByte(ip++), 0);
         auto cx = ReadReg(cpu, CX, 1);
         cx--;
         WriteReg(cpu, CX, 1, cx);
         if (cx != 0 && (!(flags & ZF) ^ (op & 1)) + (op & 2)) {
             ip += off;
+            Branch(cpu);
         }
         return Normal;
     }
@@ -1282,11 +1366,14 @@ struct CPU::Operations {
     static int Jcxz(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto off = SignExtend(cpu->ReadByte(CS, ip++), 0);
+        auto off = SignExtend(cpu->FetchByte(ip++), 0);
         auto cx = ReadReg(cpu, CX, 1);
         cx--;
         WriteReg(cpu, CX, 1, cx);
         ip += off * (cx == 0);
+        if (cx == 0) {
+            Branch(cpu);
+        }
         return Normal;
     }
 
@@ -1297,7 +1384,7 @@ struct CPU::Operations {
         if (op & 8) {
             port = cpu->state.gpr[DX];
         } else {
-            port = cpu->ReadByte(CS, ip++);
+            port = cpu->FetchByte(ip++);
         }
         auto logSz = op & 1;
         RegVal temp;
@@ -1306,6 +1393,7 @@ struct CPU::Operations {
         } else {
             temp = cpu->hook->ReadIOWord(port);
         }
+        cpu->FlushFetch();
         WriteReg(cpu, AX, logSz, temp);
         return Normal;
     }
@@ -1317,15 +1405,17 @@ struct CPU::Operations {
         if (op & 8) {
             port = cpu->state.gpr[DX];
         } else {
-            port = cpu->ReadByte(CS, ip++);
+            port = cpu->FetchByte(ip++);
         }
         auto logSz = op & 1;
         RegVal temp = ReadReg(cpu, AX, logSz);
+        ++cpu->writes;
         if (!logSz) {
             cpu->hook->WriteIOByte(port, temp);
         } else {
             cpu->hook->WriteIOWord(port, temp);
         }
+        cpu->FlushFetch();
         return Normal;
     }
 
@@ -1333,21 +1423,25 @@ struct CPU::Operations {
     {
         auto& ip = cpu->state.ip;
         auto logSz = !(op & 2);
-        auto off = SignExtend(cpu->ReadMem(CS, ip, logSz), logSz);
+        auto off = SignExtend(cpu->Fetch(ip, logSz), logSz);
         ip += off + (1 << logSz);
+        Branch(cpu);
+        if (!logSz && off >= 0x8000) {
+            cpu->Spin();
+        }
         return Normal;
     }
 
     static int JmpF(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         auto& ip = cpu->state.ip;
-        auto& cs = cpu->state.sregs[CS];
         auto logSz = 1;
-        auto off = cpu->ReadMem(CS, ip, logSz);
+        auto off = cpu->Fetch(ip, logSz);
         ip += 1 << logSz;
-        auto seg = cpu->ReadWord(CS, ip);
-        cs = seg;
+        auto seg = cpu->FetchWord(ip);
+        cpu->LoadSeg(CS, seg);
         ip = off;
+        Branch(cpu);
         return Normal;
     }
 
@@ -1355,10 +1449,11 @@ struct CPU::Operations {
     {
         auto& ip = cpu->state.ip;
         auto logSz = 1;
-        auto off = SignExtend(cpu->ReadByte(CS, ip), logSz);
+        auto off = SignExtend(cpu->FetchByte(ip), logSz);
         ip += 1 << logSz;
         PushVal(cpu, logSz, ip);
         ip += off;
+        Branch(cpu);
         return Normal;
     }
 
@@ -1379,7 +1474,7 @@ struct CPU::Operations {
         calc.n[0] = ReadRM(cpu, prefixes, modrm, logSz);
         switch (modrm.reg) {
         case Test:
-            calc.n[1] = cpu->ReadMem(CS, ip, logSz);
+            calc.n[1] = cpu->Fetch(ip, logSz);
             calc.DoOp(calc.And);
             flags = calc.GetFlags(flags);
             break;
@@ -1573,6 +1668,7 @@ struct CPU::Operations {
         case Call:
             PushVal(cpu, 1, ip);
             ip = ReadRM(cpu, prefixes, modrm, 1);
+            Branch(cpu);
             break;
         case CallF:
             if (modrm.type == modrm.Reg) {
@@ -1582,10 +1678,12 @@ struct CPU::Operations {
             PushVal(cpu, 1, ip);
             ip = cpu->ReadWord(sreg, modrm.addr);
             modrm.addr += 2;
-            cpu->state.sregs[CS] = cpu->ReadWord(sreg, modrm.addr);
+            cpu->LoadSeg(CS, cpu->ReadWord(sreg, modrm.addr));
+            Branch(cpu);
             break;
         case Jmp:
             ip = ReadRM(cpu, prefixes, modrm, 1);
+            Branch(cpu);
             break;
         case JmpF:
             if (modrm.type == modrm.Reg) {
@@ -1593,7 +1691,8 @@ struct CPU::Operations {
             }
             ip = cpu->ReadWord(sreg, modrm.addr);
             modrm.addr += 2;
-            cpu->state.sregs[CS] = cpu->ReadWord(sreg, modrm.addr);
+            cpu->LoadSeg(CS, cpu->ReadWord(sreg, modrm.addr));
+            Branch(cpu);
             break;
         case Push:
             PushVal(cpu, logSz, ReadRM(cpu, prefixes, modrm, logSz));
@@ -1610,6 +1709,177 @@ struct CPU::Operations {
         throw CPUException(CPUException::UD);
     }
 
+    static constexpr size_t HyperChunk = 256;
+
+    static constexpr auto crcTable = [] {
+        std::array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            auto crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = crc >> 1 ^ (crc & 1 ? 0x82F63B78 : 0);
+            }
+            table[i] = crc;
+        }
+        return table;
+    }();
+
+    static auto Crc32c(uint32_t crc, const uint8_t* data, size_t size) -> uint32_t
+    {
+        size_t i = 0;
+#if defined(__SSE4_2__) && defined(__x86_64__)
+        uint64_t wide = crc;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t chunk;
+            std::memcpy(&chunk, data + i, sizeof(chunk));
+            wide = _mm_crc32_u64(wide, chunk);
+        }
+        crc = uint32_t(wide);
+#endif
+        for (; i < size; ++i) {
+            crc = crcTable[(crc ^ data[i]) & 0xFF] ^ crc >> 8;
+        }
+        return crc;
+    }
+
+    template <class F>
+    static void HyperRead(CPU* cpu, uint32_t addr, size_t size, F&& f)
+    {
+        uint8_t buffer[HyperChunk];
+        while (size) {
+            addr &= AddressMask;
+            auto limit = std::min<size_t>(size, AddressMask + 1 - addr);
+            auto span = cpu->hook->Direct(addr, false);
+            auto chunk = std::min(limit, span.size);
+            const uint8_t* data = span.data;
+            if (chunk == 0) {
+                chunk = std::min(limit, sizeof(buffer));
+                cpu->ReadBlock(addr, buffer, chunk, IIOHook::Data);
+                data = buffer;
+            }
+            f(data, chunk);
+            addr += uint32_t(chunk);
+            size -= chunk;
+        }
+    }
+
+    template <class F>
+    static void HyperWrite(CPU* cpu, uint32_t addr, size_t size, F&& f)
+    {
+        uint8_t buffer[HyperChunk];
+        while (size) {
+            addr &= AddressMask;
+            auto limit = std::min<size_t>(size, AddressMask + 1 - addr);
+            auto span = cpu->hook->Direct(addr, true);
+            auto chunk = std::min(limit, span.size);
+            if (chunk) {
+                cpu->Touch(addr, chunk);
+                f(span.data, chunk);
+            } else {
+                chunk = std::min(limit, sizeof(buffer));
+                f(buffer, chunk);
+                cpu->WriteBlock(addr, buffer, chunk, IIOHook::Data);
+            }
+            addr += uint32_t(chunk);
+            size -= chunk;
+        }
+    }
+
+    static void HyperCopy(CPU* cpu, uint32_t src, uint32_t dst, size_t count)
+    {
+        src &= AddressMask;
+        dst &= AddressMask;
+        auto from = cpu->hook->Direct(src, false);
+        auto to = cpu->hook->Direct(dst, true);
+        auto wraps = src + count > AddressMask + 1 || dst + count > AddressMask + 1;
+        if (!wraps && from.size >= count && to.size >= count) {
+            cpu->Touch(dst, count);
+            std::memmove(to.data, from.data, count);
+            return;
+        }
+        std::vector<uint8_t> data(count);
+        auto pos = data.data();
+        HyperRead(cpu, src, count, [&](const uint8_t* chunk, size_t size) {
+            pos = std::copy_n(chunk, size, pos);
+        });
+        pos = data.data();
+        HyperWrite(cpu, dst, count, [&](uint8_t* chunk, size_t size) {
+            std::memcpy(chunk, pos, size);
+            pos += size;
+        });
+    }
+
+    static auto HyperCompare(CPU* cpu, uint32_t src, uint32_t dst, size_t count, bool& below) -> size_t
+    {
+        std::vector<uint8_t> data(count);
+        auto pos = data.data();
+        HyperRead(cpu, dst, count, [&](const uint8_t* chunk, size_t size) {
+            pos = std::copy_n(chunk, size, pos);
+        });
+        size_t offset = 0;
+        auto found = false;
+        HyperRead(cpu, src, count, [&](const uint8_t* chunk, size_t size) {
+            if (found) {
+                return;
+            }
+            auto other = data.data() + offset;
+            if (std::memcmp(chunk, other, size) == 0) {
+                offset += size;
+                return;
+            }
+            auto [at, against] = std::mismatch(chunk, chunk + size, other);
+            offset += at - chunk;
+            below = *at < *against;
+            found = true;
+        });
+        return offset;
+    }
+
+    static int Hyper(CPU* cpu, Prefixes& prefixes, uint8_t op)
+    {
+        if (!cpu->hypercalls) {
+            throw CPUException(CPUException::UD);
+        }
+        auto& ip = cpu->state.ip;
+        auto& regs = cpu->state.gpr;
+        auto& flags = cpu->state.flags;
+        auto function = cpu->FetchByte(ip++);
+        auto src = cpu->CalcAddr(GetSeg(prefixes), regs[SI]);
+        auto dst = cpu->CalcAddr(ES, regs[DI]);
+        size_t count = regs[CX];
+        flags &= ~(CF | ZF);
+        switch (function) {
+        case CPU::HyperCopy:
+            HyperCopy(cpu, src, dst, count);
+            break;
+        case CPU::HyperFill:
+            HyperWrite(cpu, dst, count, [fill = uint8_t(regs[AX])](uint8_t* chunk, size_t size) {
+                std::memset(chunk, fill, size);
+            });
+            break;
+        case CPU::HyperCompare: {
+            auto below = false;
+            auto offset = HyperCompare(cpu, src, dst, count, below);
+            flags |= (offset == count ? ZF : 0) | (below ? CF : 0);
+            regs[AX] = RegVal(offset);
+            break;
+        }
+        case CPU::HyperChecksum: {
+            auto crc = ~(uint32_t(regs[DX]) << 16 | regs[AX]);
+            HyperRead(cpu, src, count, [&](const uint8_t* chunk, size_t size) {
+                crc = Crc32c(crc, chunk, size);
+            });
+            crc = ~crc;
+            regs[AX] = RegVal(crc);
+            regs[DX] = RegVal(crc >> 16);
+            break;
+        }
+        default:
+            flags |= CF;
+            break;
+        }
+        return Normal;
+    }
+
     static int Lock(CPU* cpu, Prefixes& prefixes, uint8_t op)
     {
         prefixes.grp1 = PF0;
@@ -1622,6 +1892,49 @@ struct CPU::Operations {
         return Continue;
     }
 
+    enum Fusion {
+        FuseHead = 1,
+        FuseTail = 2
+    };
+
+    static constexpr auto fusion = [] {
+        std::array<uint8_t, 256> table{};
+        for (int op = 0; op < 0x40; ++op) {
+            table[op] = (op & 7) < 6 ? FuseHead : 0;
+        }
+        for (int op = 0x40; op < 0x50; ++op) {
+            table[op] = FuseHead;
+        }
+        for (int op = 0x70; op < 0x80; ++op) {
+            table[op] = FuseTail;
+        }
+        for (int op : { 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0xA8, 0xA9, 0xAA, 0xAB, 0xFE }) {
+            table[op] = FuseHead;
+        }
+        for (int op : { 0xE0, 0xE1, 0xE2, 0xE3 }) {
+            table[op] = FuseTail;
+        }
+        return table;
+    }();
+
+    static void Fuse(CPU* cpu)
+    {
+        auto& ip = cpu->state.ip;
+        auto offset = cpu->CalcAddr(CS, ip) - cpu->windowAddr;
+        if (offset >= cpu->windowSize || cpu->windowSize - offset < 2) {
+            return;
+        }
+        auto op = cpu->fetch[offset];
+        if (!(fusion[op] & FuseTail) || cpu->halt.load(std::memory_order_relaxed) || !cpu->BulkAllowed()) {
+            return;
+        }
+        Prefixes prefixes = { 0, SegReserve };
+        cpu->oldflags = cpu->state.flags;
+        ++ip;
+        ++cpu->retired;
+        map1[op](cpu, prefixes, op);
+    }
+
     using Op = int(CPU*, Prefixes&, uint8_t op);
     static Op* map1[256];
 };
@@ -1653,7 +1966,7 @@ CPU::Operations::map1[256] = {
     MovImm, MovImm, MovImm, MovImm, MovImm, MovImm, MovImm, MovImm, // 0xB0
     MovImm, MovImm, MovImm, MovImm, MovImm, MovImm, MovImm, MovImm, // 0xB8
     ShiftI, ShiftI, RetI, Ret, Lxs, Lxs, MovI, MovI, // 0xC0
-    Ud, Ud, RetFI, RetF, Int3, Int, IntO, IRet, // 0xC8
+    Hyper, Ud, RetFI, RetF, Int3, Int, IntO, IRet, // 0xC8
     Shift1, Shift1, ShiftC, ShiftC, AAM, AAD, Ud, Xlat, // 0xD0
     Esc, Esc, Esc, Esc, Esc, Esc, Esc, Esc, // 0xD8
     Loopcc, Loopcc, Loopcc, Jcxz, In, In, Out, Out, // 0xE0
@@ -1664,14 +1977,48 @@ CPU::Operations::map1[256] = {
 
 void CPU::InitInterrupt(int interrupt)
 {
-    auto off = ReadWord(interrupt * 4);
-    auto seg = ReadWord(interrupt * 4 + 2);
-    Operations::PushVal(this, 1, state.flags);
-    Operations::PushVal(this, 1, state.sregs[CS]);
-    Operations::PushVal(this, 1, state.ip);
+    if (handlers && handlers[interrupt] && handlers[interrupt](*this, interrupt)) {
+        LoadBases();
+        FlushFetch();
+        return;
+    }
+    if (!ivtCached) {
+        auto span = hook->Direct(0, false);
+        ivt = span.size >= IvtSize ? span.data : nullptr;
+        ivtCached = true;
+    }
+    uint8_t buffer[4];
+    auto vector = ivt ? ivt + interrupt * 4 : buffer;
+    if (!ivt) {
+        ReadBlock(interrupt * 4, buffer, sizeof(buffer), IIOHook::Data);
+    }
+    auto off = vector[1] * 0x100 + vector[0];
+    auto seg = vector[3] * 0x100 + vector[2];
+    auto& sp = state.gpr[SP];
+    if (sp >= 6) {
+        uint8_t frame[6];
+        RegVal words[3] = { state.ip, state.sregs[CS], state.flags };
+        for (int i = 0; i < 3; ++i) {
+            frame[i * 2] = uint8_t(words[i]);
+            frame[i * 2 + 1] = uint8_t(words[i] >> 8);
+        }
+        sp -= 6;
+        auto addr = CalcAddr(SS, sp);
+        auto span = hook->Direct(addr, true);
+        if (span.size >= sizeof(frame)) {
+            Touch(addr, sizeof(frame));
+            std::memcpy(span.data, frame, sizeof(frame));
+        } else {
+            WriteBlock(addr, frame, sizeof(frame), IIOHook::Stack);
+        }
+    } else {
+        Operations::PushVal(this, 1, state.flags);
+        Operations::PushVal(this, 1, state.sregs[CS]);
+        Operations::PushVal(this, 1, state.ip);
+    }
     state.flags ^= state.flags & (IF | TF);
     state.ip = off;
-    state.sregs[CS] = seg;
+    LoadSeg(CS, seg);
 }
 
 auto CPU::InitState() -> CPUState
@@ -1696,10 +2043,82 @@ void CPU::SetINTR(int interrupt)
     intr.store(interrupt, std::memory_order_release);
 }
 
+auto CPU::Instructions() const -> uint64_t
+{
+    return instructions;
+}
+
+void CPU::SetCoverage(uint8_t *bitmap, std::size_t size)
+{
+    if (bitmap && (!std::has_single_bit(size) || uint64_t(size) > uint64_t(1) << 32)) {
+        throw std::runtime_error("Coverage size must be a power of two");
+    }
+    coverage = bitmap;
+    coverageMask = uint32_t(size - 1);
+    prevLocation = 0;
+}
+
+void CPU::ResetCoverage()
+{
+    prevLocation = 0;
+}
+
+void CPU::SetHandler(uint8_t vector, Handler handler)
+{
+    if (!handlers) {
+        handlers = std::make_unique<Handler[]>(256);
+    }
+    handlers[vector] = std::move(handler);
+}
+
+void CPU::SetHypercalls(bool enable)
+{
+    hypercalls = enable;
+}
+
+void CPU::Read(uint32_t addr, void *data, size_t size)
+{
+    auto out = static_cast<uint8_t*>(data);
+    while (size) {
+        addr &= AddressMask;
+        auto span = hook->Direct(addr, false);
+        if (!span.size) {
+            ReadBlock(addr, out, size, IIOHook::Data);
+            return;
+        }
+        auto chunk = std::min(size, span.size);
+        std::memcpy(out, span.data, chunk);
+        out += chunk;
+        addr += uint32_t(chunk);
+        size -= chunk;
+    }
+}
+
+void CPU::Write(uint32_t addr, const void *data, size_t size)
+{
+    hook->HostWrite(addr & AddressMask, data, size);
+    auto in = static_cast<const uint8_t*>(data);
+    while (size) {
+        addr &= AddressMask;
+        auto span = hook->Direct(addr, true);
+        if (!span.size) {
+            WriteBlock(addr, const_cast<uint8_t*>(in), size, IIOHook::Data);
+            return;
+        }
+        auto chunk = std::min(size, span.size);
+        Touch(addr, chunk);
+        std::memcpy(span.data, in, chunk);
+        in += chunk;
+        addr += uint32_t(chunk);
+        size -= chunk;
+    }
+}
+
 int CPU::DoStep()
 {
     int result;
     auto prevIP = state.ip;
+    retired = 1;
     try {
         oldflags &= state.flags;
         if (halt.load(std::memory_order_acquire)) {
@@ -1709,36 +2128,46 @@ int CPU::DoStep()
             InitInterrupt(CPUException::DB);
         }
         if (nmi.load(std::memory_order_acquire)) {
+            hook->AcceptInterrupt(NonMaskable);
             InitInterrupt(CPUException::NMI);
         }
         if (oldflags & IF) {
             auto interrupt = intr.load(std::memory_order_acquire);
             if (interrupt != NoInterrupt) {
+                hook->AcceptInterrupt(interrupt);
                 InitInterrupt(interrupt);
             }
         }
         oldflags = state.flags;
         prevIP = state.ip;
+        auto linear = CalcAddr(CS, state.ip);
+        if (linear - windowAddr >= windowSize || windowSize - (linear - windowAddr) < MinFetch) {
+            Prefetch(linear);
+        }
         Prefixes prefixes = { 0, SegReserve };
+        uint8_t op;
         do {
-            auto op = ReadByte(CS, state.ip++);
+            op = FetchByte(state.ip++);
             result = Operations::map1[op](this, prefixes, op);
         } while (result == Continue);
         if (result == Repeat) {
             state.ip = prevIP;
+        } else if (result == Normal && retired < budget && (Operations::fusion[op] & Operations::FuseHead)) {
+            Operations::Fuse(this);
         }
     } catch (CPUException& e) {
         state.ip = prevIP;
         InitInterrupt(e.GetException());
         result = Normal;
     }
+    instructions += retired;
     return result;
 }
 
 auto CPU::ParsePrefixes() -> Prefixes
 {
     Prefixes prefixes = { 0, SegReserve };
-    auto op = ReadByte(CS, state.ip);
+    auto op = FetchByte(state.ip);
     while (true) {
         switch (op) {
         case 0x26:
@@ -1781,111 +2210,316 @@ auto CPU::ParsePrefixes() -> Prefixes
     }
 }
 
-auto CPU::ReadByte(SegmentRegister sreg, uint16_t addr) -> uint8_t
+auto CPU::ReadByte(SegmentRegister sreg, uint16_t addr, IIOHook::Access access) -> uint8_t
 {
-    return ReadByte(CalcAddr(sreg, addr));
+    return ReadByte(CalcAddr(sreg, addr), access);
 }
 
-uint16_t CPU::ReadWord(SegmentRegister sreg, uint16_t addr)
+uint16_t CPU::ReadWord(SegmentRegister sreg, uint16_t addr, IIOHook::Access access)
 {
-    return ReadWord(CalcAddr(sreg, addr));
+    return ReadWord(CalcAddr(sreg, addr), access);
 }
 
-auto CPU::ReadMem(SegmentRegister sreg, uint16_t addr, int logSz) -> RegVal
+auto CPU::ReadMem(SegmentRegister sreg, uint16_t addr, int logSz, IIOHook::Access access) -> RegVal
 {
-    RegVal result;
+    RegVal result = 0;
     switch(logSz) {
     case 0:
-        result = ReadByte(CalcAddr(sreg, addr));
+        result = ReadByte(CalcAddr(sreg, addr), access);
         break;
     case 1:
-        result = ReadWord(CalcAddr(sreg, addr));
+        result = ReadWord(CalcAddr(sreg, addr), access);
         break;
     }
     return result;
 }
 
-void CPU::WriteByte(SegmentRegister sreg, uint16_t addr, uint8_t val)
+void CPU::WriteByte(SegmentRegister sreg, uint16_t addr, uint8_t val, IIOHook::Access access)
 {
-    WriteByte(CalcAddr(sreg, addr), val);
+    WriteByte(CalcAddr(sreg, addr), val, access);
 }
 
-void CPU::WriteWord(SegmentRegister sreg, uint16_t addr, uint16_t val)
+void CPU::WriteWord(SegmentRegister sreg, uint16_t addr, uint16_t val, IIOHook::Access access)
 {
-    WriteWord(CalcAddr(sreg, addr), val);
+    WriteWord(CalcAddr(sreg, addr), val, access);
 }
 
-void CPU::WriteMem(SegmentRegister sreg, uint16_t addr, int logSz, RegVal val)
+void CPU::WriteMem(SegmentRegister sreg, uint16_t addr, int logSz, RegVal val, IIOHook::Access access)
 {
     switch(logSz) {
     case 0:
-        WriteByte(CalcAddr(sreg, addr), val);
+        WriteByte(CalcAddr(sreg, addr), val, access);
         break;
     case 1:
-        WriteWord(CalcAddr(sreg, addr), val);
+        WriteWord(CalcAddr(sreg, addr), val, access);
         break;
     }
 }
 
-auto CPU::ReadByte(uint32_t addr) -> uint8_t
+auto CPU::ReadByte(uint32_t addr, IIOHook::Access access) -> uint8_t
 {
     unsigned char byte;
-    hook->ReadMem(state, &byte, sizeof(byte), addr);
+    ReadBlock(addr, &byte, sizeof(byte), access);
     return byte;
 }
 
-uint16_t CPU::ReadWord(uint32_t addr)
+uint16_t CPU::ReadWord(uint32_t addr, IIOHook::Access access)
 {
     unsigned char word[2];
-    hook->ReadMem(state, word, sizeof(word), addr);
+    ReadBlock(addr, word, sizeof(word), access);
     return word[1] * 0x100 + word[0];
 }
 
-auto CPU::ReadMem(uint32_t addr, int logSz) -> RegVal
+auto CPU::ReadMem(uint32_t addr, int logSz, IIOHook::Access access) -> RegVal
 {
     RegVal result = 0;
     switch(logSz) {
     case 0:
-        result = ReadByte(addr);
+        result = ReadByte(addr, access);
         break;
     case 1:
-        result = ReadWord(addr);
+        result = ReadWord(addr, access);
         break;
     }
     return result;
 }
 
-void CPU::WriteByte(uint32_t addr, uint8_t val)
+void CPU::WriteByte(uint32_t addr, uint8_t val, IIOHook::Access access)
 {
     unsigned char byte = val;
-    hook->WriteMem(state, addr, &byte, sizeof(byte));
+    WriteBlock(addr, &byte, sizeof(byte), access);
 }
 
-void CPU::WriteWord(uint32_t addr, uint16_t val)
+void CPU::WriteWord(uint32_t addr, uint16_t val, IIOHook::Access access)
 {
     unsigned char word[2];
     for (int i = 0; i < sizeof(val); ++i) {
         word[i] = val;
         val >>= 8;
     }
-    hook->WriteMem(state, addr, &word, sizeof(word));
+    WriteBlock(addr, word, sizeof(word), access);
 }
 
-void CPU::WriteMem(uint32_t addr, int logSz, RegVal val)
+void CPU::WriteMem(uint32_t addr, int logSz, RegVal val, IIOHook::Access access)
 {
     switch(logSz) {
     case 0:
-        WriteByte(addr, val);
+        WriteByte(addr, val, access);
         break;
     case 1:
-        WriteWord(addr, val);
+        WriteWord(addr, val, access);
         break;
     }
 }
 
+void CPU::ReadBlock(uint32_t addr, void *data, size_t size, IIOHook::Access access)
+{
+    if (access == IIOHook::Data) {
+        hook->ReadMem(state, data, size, addr);
+    } else {
+        hook->ReadBlock(state, data, size, addr, access);
+    }
+}
+
+void CPU::WriteBlock(uint32_t addr, void *data, size_t size, IIOHook::Access access)
+{
+    Touch(addr, size);
+    if (access == IIOHook::Data) {
+        hook->WriteMem(state, addr, data, size);
+    } else {
+        hook->WriteBlock(state, addr, data, size, access);
+    }
+}
+
+auto CPU::BulkAllowed() const -> bool
+{
+    if ((state.flags & TF) || nmi.load(std::memory_order_relaxed)) {
+        return false;
+    }
+    return !(state.flags & IF) || intr.load(std::memory_order_relaxed) == NoInterrupt;
+}
+
+auto CPU::BulkCopy(SegmentRegister sreg, int logSz, RegVal counter) -> RegVal
+{
+    if (!BulkAllowed() || (state.flags & DF)) {
+        return 0;
+    }
+    auto& si = state.gpr[SI];
+    auto& di = state.gpr[DI];
+    auto n = std::min({ uint32_t(counter), budget, MaxBulk >> logSz, (0x10000u - si) >> logSz, (0x10000u - di) >> logSz });
+    if (n < 2) {
+        return 0;
+    }
+    auto at = CalcAddr(sreg, si);
+    auto to = CalcAddr(ES, di);
+    auto dst = hook->Direct(to, true);
+    auto src = hook->Direct(at, false);
+    n = std::min({ n, uint32_t(src.size >> logSz), uint32_t(dst.size >> logSz) });
+    if (to > at && to - at < (n << logSz)) {
+        n = (to - at) >> logSz;
+    }
+    auto from = reinterpret_cast<std::uintptr_t>(src.data);
+    auto into = reinterpret_cast<std::uintptr_t>(dst.data);
+    if (into > from && into - from < (n << logSz)) {
+        n = uint32_t(into - from) >> logSz;
+    }
+    auto bytes = n << logSz;
+    if (n < 2) {
+        return 0;
+    }
+    Touch(to, bytes);
+    std::memmove(dst.data, src.data, bytes);
+    si += bytes;
+    di += bytes;
+    retired = n;
+    return n;
+}
+
+auto CPU::BulkFill(int logSz, RegVal counter) -> RegVal
+{
+    if (!BulkAllowed() || (state.flags & DF)) {
+        return 0;
+    }
+    auto& di = state.gpr[DI];
+    auto n = std::min({ uint32_t(counter), budget, MaxBulk >> logSz, (0x10000u - di) >> logSz });
+    if (n < 2) {
+        return 0;
+    }
+    auto to = CalcAddr(ES, di);
+    auto dst = hook->Direct(to, true);
+    n = std::min(n, uint32_t(dst.size >> logSz));
+    auto bytes = n << logSz;
+    if (n < 2) {
+        return 0;
+    }
+    Touch(to, bytes);
+    auto ax = state.gpr[AX];
+    if (logSz == 0) {
+        std::memset(dst.data, uint8_t(ax), bytes);
+    } else {
+        for (uint32_t i = 0; i < bytes; i += 2) {
+            dst.data[i] = uint8_t(ax);
+            dst.data[i + 1] = uint8_t(ax >> 8);
+        }
+    }
+    di += bytes;
+    retired = n;
+    return n;
+}
+
+auto CPU::FetchByte(uint16_t addr) -> uint8_t
+{
+    auto linear = CalcAddr(CS, addr);
+    if (linear - windowAddr >= windowSize) {
+        Prefetch(linear);
+    }
+    return fetch[linear - windowAddr];
+}
+
+auto CPU::FetchWord(uint16_t addr) -> uint16_t
+{
+    if (addr == 0xFFFF) {
+        auto low = FetchByte(addr);
+        return FetchByte(0) * 0x100 + low;
+    }
+    auto linear = CalcAddr(CS, addr);
+    auto offset = linear - windowAddr;
+    if (offset >= windowSize || windowSize - offset < 2) {
+        Prefetch(linear, 2);
+        offset = 0;
+    }
+    return fetch[offset + 1] * 0x100 + fetch[offset];
+}
+
+auto CPU::Fetch(uint16_t addr, int logSz) -> RegVal
+{
+    return logSz ? FetchWord(addr) : FetchByte(addr);
+}
+
+void CPU::Prefetch(uint32_t addr, uint32_t size)
+{
+    auto span = hook->Direct(addr, false);
+    windowAddr = addr;
+    if (span.size >= size) {
+        fetch = span.data;
+        windowSize = uint32_t(std::min<size_t>(span.size, MaxBulk));
+        return;
+    }
+    auto offset = addr - bases[CS];
+    auto n = std::min({ uint32_t(sizeof(window)), 0x10000 - offset, FetchPage - (addr & (FetchPage - 1)) });
+    n = std::max(n, size);
+    hook->ReadBlock(state, window, n, addr, IIOHook::Fetch);
+    fetch = window;
+    windowSize = n;
+}
+
+void CPU::FlushFetch()
+{
+    windowSize = 0;
+    ivtCached = false;
+}
+
+void CPU::Touch(uint32_t addr, size_t size)
+{
+    ++writes;
+    if (addr - windowAddr < windowSize || windowAddr - addr < size) {
+        FlushFetch();
+    }
+    if (addr < IvtSize) {
+        ivtCached = false;
+    }
+}
+
+void CPU::LoadSeg(int sreg, uint16_t val)
+{
+    state.sregs[sreg] = val;
+    bases[sreg] = val * 0x10;
+}
+
+void CPU::LoadBases()
+{
+    for (int i = 0; i < SegReserve; ++i) {
+        bases[i] = state.sregs[i] * 0x10;
+    }
+}
+
 auto CPU::CalcAddr(SegmentRegister sreg, uint16_t addr) -> uint32_t
 {
-    return addr + state.sregs[sreg] * 0x10;
+    return addr + bases[sreg];
+}
+
+void CPU::Edge()
+{
+    uint32_t location = CalcAddr(CS, state.ip);
+    location = (location * 0x9E3779B1u) >> 12;
+    coverage[(location ^ prevLocation) & coverageMask]++;
+    prevLocation = location >> 1;
+}
+
+void CPU::Spin()
+{
+    auto now = instructions + retired;
+    auto target = CalcAddr(CS, state.ip);
+    if (target != spinTarget || writes != spinWrites || std::memcmp(&state, &spinState, sizeof(state)) != 0) {
+        spinTarget = target;
+        spinWrites = writes;
+        spinAt = now;
+        spinState = state;
+        return;
+    }
+    auto since = spinAt;
+    auto period = now - since;
+    spinAt = now;
+    if (coverage || retired >= budget || halt.load(std::memory_order_relaxed) || !BulkAllowed()) {
+        return;
+    }
+    auto stable = hook->StableUntil(since);
+    if (stable <= now) {
+        return;
+    }
+    auto skip = std::min<uint64_t>(stable - now, budget - retired) / period * period;
+    retired += uint32_t(skip);
+    spinAt += skip;
 }
 
 } // namespace x86emu
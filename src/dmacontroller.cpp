@@ -0,0 +1,213 @@
+#include "include/cpu86e/dmacontroller.h"
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace cpu86e {
+
+DmaController::DmaController(CPU &cpu, Scheduler &scheduler) :
+    cpu(&cpu),
+    scheduler(&scheduler),
+    channels{},
+    mask(0),
+    status(0),
+    flipFlop(false),
+    pending(0),
+    asserted(false),
+    bytes(0)
+{
+    for (auto& channel : channels) {
+        channel.interrupt = CPU::NoInterrupt;
+    }
+    Reset();
+}
+
+auto DmaController::ReadPort(uint32_t port) -> uint8_t
+{
+    if (port < Channels * 2) {
+        auto& channel = channels[port / 2];
+        auto val = port & 1 ? channel.count : channel.address;
+        auto high = flipFlop;
+        flipFlop = !flipFlop;
+        return uint8_t(high ? val >> 8 : val);
+    }
+    if (port >= Page && port < Ports) {
+        return channels[port - Page].page;
+    }
+    if (port == Status) {
+        auto val = status;
+        status &= 0xF0;
+        pending = 0;
+        Update();
+        return val;
+    }
+    return 0xFF;
+}
+
+void DmaController::WritePort(uint32_t port, uint8_t val)
+{
+    if (port < Channels * 2) {
+        auto& channel = channels[port / 2];
+        auto& base = port & 1 ? channel.baseCount : channel.baseAddress;
+        base = flipFlop ? uint16_t((base & 0x00FF) | val << 8) : uint16_t((base & 0xFF00) | val);
+        (port & 1 ? channel.count : channel.address) = base;
+        flipFlop = !flipFlop;
+        return;
+    }
+    if (port >= Page && port < Ports) {
+        channels[port - Page].page = val;
+        return;
+    }
+    switch (port) {
+    case SingleMask:
+        if (val & 4) {
+            mask |= 1 << (val & 3);
+        } else {
+            mask &= ~(1 << (val & 3));
+        }
+        break;
+    case Mode:
+        channels[val & 3].mode = val;
+        break;
+    case ClearFlipFlop:
+        flipFlop = false;
+        break;
+    case MasterClear:
+        Reset();
+        break;
+    case ClearMask:
+        mask = 0;
+        break;
+    case AllMask:
+        mask = val & 0x0F;
+        break;
+    }
+}
+
+void DmaController::SetInterrupt(int channel, int interrupt, uint64_t delay)
+{
+    if (channel < 0 || channel >= Channels) {
+        throw std::runtime_error("Invalid DMA channel");
+    }
+    channels[channel].interrupt = interrupt;
+    channels[channel].delay = delay;
+}
+
+void DmaController::Acknowledge(int channel)
+{
+    if (channel < 0 || channel >= Channels) {
+        throw std::runtime_error("Invalid DMA channel");
+    }
+    pending &= ~(1 << channel);
+    Update();
+}
+
+auto DmaController::Transfer(int index, void *data, std::size_t size) -> std::size_t
+{
+    if (index < 0 || index >= Channels) {
+        throw std::runtime_error("Invalid DMA channel");
+    }
+    if (mask & (1 << index)) {
+        return 0;
+    }
+    auto& channel = channels[index];
+    auto left = std::size_t(channel.count) + 1;
+    auto n = std::min(size, left);
+    Copy(channel, static_cast<uint8_t*>(data), n);
+    bytes += n;
+    if (n < left) {
+        channel.count = uint16_t(channel.count - n);
+        return n;
+    }
+    status |= 1 << index;
+    if (channel.mode & AutoInit) {
+        channel.address = channel.baseAddress;
+        channel.count = channel.baseCount;
+    } else {
+        channel.count = 0xFFFF;
+        mask |= 1 << index;
+    }
+    Complete(index);
+    return n;
+}
+
+auto DmaController::Remaining(int channel) const -> std::size_t
+{
+    if (channel < 0 || channel >= Channels) {
+        throw std::runtime_error("Invalid DMA channel");
+    }
+    return std::size_t(channels[channel].count) + 1;
+}
+
+auto DmaController::Bytes() const -> uint64_t
+{
+    return bytes;
+}
+
+void DmaController::Reset()
+{
+    for (auto& channel : channels) {
+        channel.baseAddress = channel.address = 0;
+        channel.baseCount = channel.count = 0;
+        channel.mode = 0;
+    }
+    mask = 0x0F;
+    status = 0;
+    flipFlop = false;
+    pending = 0;
+    Update();
+}
+
+void DmaController::Copy(Channel &channel, uint8_t *data, std::size_t size)
+{
+    auto type = channel.mode & TransferMask;
+    auto down = (channel.mode & Decrement) != 0;
+    while (size) {
+        auto chunk = std::min<std::size_t>(size, down ? channel.address + 1u : 0x10000u - channel.address);
+        auto first = down ? channel.address - (chunk - 1) : channel.address;
+        auto linear = uint32_t(channel.page) << 16 | uint32_t(first);
+        if (type == ToMemory && down) {
+            std::vector<uint8_t> reversed(std::make_reverse_iterator(data + chunk), std::make_reverse_iterator(data));
+            cpu->Write(linear, reversed.data(), chunk);
+        } else if (type == ToMemory) {
+            cpu->Write(linear, data, chunk);
+        } else if (type == FromMemory) {
+            cpu->Read(linear, data, chunk);
+            if (down) {
+                std::reverse(data, data + chunk);
+            }
+        }
+        channel.address = uint16_t(down ? channel.address - chunk : channel.address + chunk);
+        data += chunk;
+        size -= chunk;
+    }
+}
+
+void DmaController::Complete(int index)
+{
+    auto& channel = channels[index];
+    if (channel.interrupt == CPU::NoInterrupt) {
+        return;
+    }
+    scheduler->Schedule(scheduler->Now(*cpu) + channel.delay, [this, index](uint64_t) {
+        pending |= 1 << index;
+        Update();
+    });
+}
+
+void DmaController::Update()
+{
+    for (int i = 0; i < Channels; ++i) {
+        if (pending & (1 << i)) {
+            cpu->SetINTR(channels[i].interrupt);
+            asserted = true;
+            return;
+        }
+    }
+    if (asserted) {
+        cpu->SetINTR(CPU::NoInterrupt);
+        asserted = false;
+    }
+}
+
+} // namespace x86emu
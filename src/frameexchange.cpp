@@ -0,0 +1,98 @@
+#include "include/cpu86e/frameexchange.h"
+#include <algorithm>
+
+namespace cpu86e {
+
+namespace {
+
+auto Now() -> std::int64_t
+{
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+FrameExchange::FrameExchange(std::size_t size) :
+    size(size),
+    storage(new std::uint8_t[size * Slots]()),
+    back(1),
+    front(0),
+    latest(0),
+    reading(None),
+    stamps{},
+    latency(0),
+    published(0),
+    copies(0)
+{
+    stamps[0].store(Now(), std::memory_order_relaxed);
+}
+
+auto FrameExchange::Back() const -> std::uint8_t*
+{
+    return Slot(back);
+}
+
+auto FrameExchange::Front() const -> std::uint8_t*
+{
+    return Slot(front);
+}
+
+auto FrameExchange::Publish() -> std::uint8_t*
+{
+    stamps[back].store(Now(), std::memory_order_relaxed);
+    latest.store(back);
+    published.fetch_add(1, std::memory_order_relaxed);
+    auto next = front;
+    front = back;
+    if (reading.load() == next) {
+        auto spare = Slots - next - front;
+        std::copy(Slot(next), Slot(next) + size, Slot(spare));
+        copies.fetch_add(1, std::memory_order_relaxed);
+        next = spare;
+    }
+    back = next;
+    return Slot(back);
+}
+
+auto FrameExchange::Acquire() -> const std::uint8_t*
+{
+    auto index = latest.load();
+    while (true) {
+        reading.store(index);
+        auto check = latest.load();
+        if (check == index) {
+            break;
+        }
+        index = check;
+    }
+    latency.store(Now() - stamps[index].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    return Slot(index);
+}
+
+void FrameExchange::Release()
+{
+    reading.store(None, std::memory_order_release);
+}
+
+auto FrameExchange::Latency() const -> std::chrono::nanoseconds
+{
+    return std::chrono::nanoseconds(latency.load(std::memory_order_relaxed));
+}
+
+auto FrameExchange::Published() const -> std::uint64_t
+{
+    return published.load(std::memory_order_relaxed);
+}
+
+auto FrameExchange::Copies() const -> std::uint64_t
+{
+    return copies.load(std::memory_order_relaxed);
+}
+
+auto FrameExchange::Slot(int index) const -> std::uint8_t*
+{
+    return storage.get() + index * size;
+}
+
+} // namespace x86emu
@@ -0,0 +1,419 @@
+#include "include/cpu86e/framepipeline.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace cpu86e {
+
+namespace {
+
+using Palette = uint8_t[256][4];
+
+const char deltaMagic[4] = { 'C', '8', '6', 'F' };
+
+void LoadPalette(const uint8_t* frame, Palette& palette)
+{
+    auto colors = frame + FramePipeline::PaletteOffset;
+    for (int i = 0; i < 256; ++i) {
+        auto color = colors + i * 4;
+        palette[i][0] = color[2];
+        palette[i][1] = color[1];
+        palette[i][2] = color[0];
+        palette[i][3] = 0xFF;
+    }
+}
+
+void ExpandRgba(const uint8_t* pixels, const Palette& palette, uint8_t* out, std::size_t count)
+{
+    std::size_t i = 0;
+#ifdef __AVX2__
+    auto table = reinterpret_cast<const int*>(palette[0]);
+    for (; i + 8 <= count; i += 8) {
+        auto index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixels + i)));
+        auto color = _mm256_i32gather_epi32(table, index, 4);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i * 4), color);
+    }
+#endif
+    for (; i < count; ++i) {
+        auto color = palette[pixels[i]];
+        std::copy(color, color + 4, out + i * 4);
+    }
+}
+
+void ExpandRgb(const uint8_t* pixels, const Palette& palette, uint8_t* out, std::size_t count)
+{
+    std::size_t i = 0;
+#ifdef __AVX2__
+    auto table = reinterpret_cast<const int*>(palette[0]);
+    auto pack = _mm256_setr_epi8(
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+        0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    for (; i + 16 <= count; i += 8) {
+        auto index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(pixels + i)));
+        auto color = _mm256_shuffle_epi8(_mm256_i32gather_epi32(table, index, 4), pack);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 3), _mm256_castsi256_si128(color));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i * 3 + 12), _mm256_extracti128_si256(color, 1));
+    }
+#endif
+    for (; i < count; ++i) {
+        auto color = palette[pixels[i]];
+        std::copy(color, color + 3, out + i * 3);
+    }
+}
+
+void ExpandYuv(const uint8_t* pixels, const uint8_t (&lut)[3][256], uint8_t* out, std::size_t count)
+{
+    auto u = out + FramePipeline::PixelCount;
+    auto v = u + FramePipeline::PixelCount;
+    for (std::size_t i = 0; i < count; ++i) {
+        auto index = pixels[i];
+        out[i] = lut[0][index];
+        u[i] = lut[1][index];
+        v[i] = lut[2][index];
+    }
+}
+
+void LoadYuv(const Palette& palette, uint8_t (&lut)[3][256])
+{
+    for (int i = 0; i < 256; ++i) {
+        int r = palette[i][0];
+        int g = palette[i][1];
+        int b = palette[i][2];
+        lut[0][i] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+        lut[1][i] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+        lut[2][i] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+    }
+}
+
+void PutVarint(std::vector<uint8_t>& out, uint32_t val)
+{
+    while (val >= 0x80) {
+        out.push_back(uint8_t(val) | 0x80);
+        val >>= 7;
+    }
+    out.push_back(uint8_t(val));
+}
+
+auto GetVarint(const uint8_t* data, std::size_t size, std::size_t& pos) -> uint32_t
+{
+    uint32_t val = 0;
+    for (int shift = 0; pos < size && shift < 32; shift += 7) {
+        auto byte = data[pos++];
+        val |= uint32_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return val;
+        }
+    }
+    throw std::runtime_error("Truncated frame");
+}
+
+}
+
+FramePipeline::FramePipeline(int fd, Format format, std::size_t depth) :
+    fd(fd),
+    format(format),
+    depth(depth ? depth : 1),
+    output(format == Delta ? 0 : OutputSize(format)),
+    previous(FrameSize),
+    primed(false),
+    frames(0),
+    changedRows(0),
+    busy(false),
+    stop(false)
+{
+    worker = std::thread(&FramePipeline::WorkerMain, this);
+}
+
+FramePipeline::~FramePipeline()
+{
+    {
+        std::unique_lock lock(mutex);
+        space.wait(lock, [this] { return queue.empty() && !busy; });
+        stop = true;
+    }
+    ready.notify_all();
+    worker.join();
+}
+
+void FramePipeline::Submit(const std::uint8_t *frame)
+{
+    std::vector<std::uint8_t> slot;
+    {
+        std::unique_lock lock(mutex);
+        space.wait(lock, [this] { return queue.size() < depth || error; });
+        Check();
+        if (!spare.empty()) {
+            slot = std::move(spare.back());
+            spare.pop_back();
+        }
+    }
+    slot.assign(frame, frame + FrameSize);
+    {
+        std::lock_guard lock(mutex);
+        queue.push_back(std::move(slot));
+    }
+    ready.notify_one();
+}
+
+void FramePipeline::Flush()
+{
+    std::unique_lock lock(mutex);
+    space.wait(lock, [this] { return (queue.empty() && !busy) || error; });
+    Check();
+}
+
+auto FramePipeline::Frames() const -> std::uint64_t
+{
+    return frames.load(std::memory_order_acquire);
+}
+
+auto FramePipeline::ChangedRows() const -> std::uint64_t
+{
+    return changedRows.load(std::memory_order_acquire);
+}
+
+auto FramePipeline::OutputSize(Format format) -> std::size_t
+{
+    return PixelCount * (format == Rgba ? 4 : 3);
+}
+
+void FramePipeline::Convert(const std::uint8_t *frame, std::uint8_t *out, Format format)
+{
+    Convert(frame, out, format, Rows().set());
+}
+
+auto FramePipeline::Decode(const std::uint8_t *data, std::size_t size, std::uint8_t *frame) -> std::size_t
+{
+    std::size_t pos = 0;
+    if (size < 1) {
+        throw std::runtime_error("Truncated frame");
+    }
+    auto flags = data[pos++];
+    if (flags & DeltaPalette) {
+        if (size - pos < FrameSize - PaletteOffset) {
+            throw std::runtime_error("Truncated frame");
+        }
+        std::copy(data + pos, data + pos + (FrameSize - PaletteOffset), frame + PaletteOffset);
+        pos += FrameSize - PaletteOffset;
+    }
+    for (int row = 0; row < Height;) {
+        row += GetVarint(data, size, pos);
+        auto count = GetVarint(data, size, pos);
+        if (row + count > unsigned(Height)) {
+            throw std::runtime_error("Corrupt frame");
+        }
+        for (auto end = row + count; row < int(end); ++row) {
+            if (size - pos < 3) {
+                throw std::runtime_error("Truncated frame");
+            }
+            uint32_t mask = data[pos] | data[pos + 1] << 8 | data[pos + 2] << 16;
+            pos += 3;
+            for (int span = 0; span < Width / Span; ++span) {
+                if (!(mask >> span & 1)) {
+                    continue;
+                }
+                if (size - pos < Span) {
+                    throw std::runtime_error("Truncated frame");
+                }
+                auto pixels = frame + row * Width + span * Span;
+                for (int i = 0; i < Span; ++i) {
+                    pixels[i] ^= data[pos++];
+                }
+            }
+        }
+    }
+    return pos;
+}
+
+void FramePipeline::Convert(const std::uint8_t *frame, std::uint8_t *out, Format format, const Rows &rows)
+{
+    alignas(32) Palette palette;
+    LoadPalette(frame, palette);
+    uint8_t lut[3][256];
+    if (format == Y4m) {
+        LoadYuv(palette, lut);
+    }
+    for (int row = 0; row < Height; ++row) {
+        if (!rows[row]) {
+            continue;
+        }
+        auto first = row;
+        while (row + 1 < Height && rows[row + 1]) {
+            ++row;
+        }
+        auto offset = std::size_t(first) * Width;
+        auto count = std::size_t(row + 1 - first) * Width;
+        switch (format) {
+        case Rgba:
+            ExpandRgba(frame + offset, palette, out + offset * 4, count);
+            break;
+        case Rgb:
+        case Ppm:
+            ExpandRgb(frame + offset, palette, out + offset * 3, count);
+            break;
+        case Y4m:
+            ExpandYuv(frame + offset, lut, out + offset, count);
+            break;
+        case Delta:
+            break;
+        }
+    }
+}
+
+auto FramePipeline::Compare(const std::uint8_t *frame) -> Rows
+{
+    Rows rows;
+    if (!primed || !std::equal(frame + PaletteOffset, frame + FrameSize, previous.data() + PaletteOffset)) {
+        return rows.set();
+    }
+    for (int row = 0; row < Height; ++row) {
+        auto offset = std::size_t(row) * Width;
+        rows[row] = !std::equal(frame + offset, frame + offset + Width, previous.data() + offset);
+    }
+    return rows;
+}
+
+void FramePipeline::Encode(const std::uint8_t *frame, const Rows &rows)
+{
+    output.clear();
+    auto palette = !primed || !std::equal(frame + PaletteOffset, frame + FrameSize, previous.data() + PaletteOffset);
+    output.push_back(palette ? DeltaPalette : 0);
+    if (palette) {
+        output.insert(output.end(), frame + PaletteOffset, frame + FrameSize);
+    }
+    for (int row = 0; row < Height;) {
+        auto start = row;
+        while (row < Height && !rows[row]) {
+            ++row;
+        }
+        PutVarint(output, uint32_t(row - start));
+        start = row;
+        while (row < Height && rows[row]) {
+            ++row;
+        }
+        PutVarint(output, uint32_t(row - start));
+        for (auto line = start; line < row; ++line) {
+            auto pixels = frame + line * Width;
+            auto old = previous.data() + line * Width;
+            auto maskPos = output.size();
+            uint32_t mask = 0;
+            output.insert(output.end(), 3, 0);
+            for (int span = 0; span < Width / Span; ++span) {
+                auto at = span * Span;
+                if (std::equal(pixels + at, pixels + at + Span, old + at)) {
+                    continue;
+                }
+                mask |= 1u << span;
+                for (int i = 0; i < Span; ++i) {
+                    output.push_back(pixels[at + i] ^ old[at + i]);
+                }
+            }
+            output[maskPos] = uint8_t(mask);
+            output[maskPos + 1] = uint8_t(mask >> 8);
+            output[maskPos + 2] = uint8_t(mask >> 16);
+        }
+    }
+}
+
+void FramePipeline::WorkerMain()
+{
+    std::string header;
+    if (format == Y4m) {
+        header = "YUV4MPEG2 W" + std::to_string(Width) + " H" + std::to_string(Height) + " F60:1 Ip A1:1 C444\n";
+    } else if (format == Delta) {
+        header = std::string(deltaMagic, sizeof(deltaMagic));
+        header += char(Width & 0xFF);
+        header += char(Width >> 8);
+        header += char(Height & 0xFF);
+        header += char(Height >> 8);
+    }
+    try {
+        Write(reinterpret_cast<const uint8_t*>(header.data()), header.size());
+    } catch (...) {
+        std::lock_guard lock(mutex);
+        error = std::current_exception();
+    }
+    while (true) {
+        std::vector<std::uint8_t> slot;
+        {
+            std::unique_lock lock(mutex);
+            ready.wait(lock, [this] { return !queue.empty() || stop; });
+            if (queue.empty()) {
+                return;
+            }
+            slot = std::move(queue.front());
+            queue.pop_front();
+            busy = true;
+        }
+        try {
+            if (!error) {
+                auto rows = Compare(slot.data());
+                if (format == Delta) {
+                    Encode(slot.data(), rows);
+                } else {
+                    Convert(slot.data(), output.data(), format, rows);
+                }
+                if (format == Ppm) {
+                    auto header = "P6\n" + std::to_string(Width) + " " + std::to_string(Height) + "\n255\n";
+                    Write(reinterpret_cast<const uint8_t*>(header.data()), header.size());
+                } else if (format == Y4m) {
+                    Write(reinterpret_cast<const uint8_t*>("FRAME\n"), 6);
+                }
+                Write(output.data(), output.size());
+                primed = true;
+                previous.swap(slot);
+                changedRows.fetch_add(rows.count(), std::memory_order_relaxed);
+                frames.fetch_add(1, std::memory_order_release);
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            error = std::current_exception();
+        }
+        {
+            std::lock_guard lock(mutex);
+            if (!slot.empty()) {
+                spare.push_back(std::move(slot));
+            }
+            busy = false;
+        }
+        space.notify_all();
+    }
+}
+
+void FramePipeline::Write(const std::uint8_t *data, std::size_t size)
+{
+    while (size) {
+#ifdef _WIN32
+        auto written = _write(fd, data, unsigned(std::min<std::size_t>(size, 1 << 30)));
+#else
+        auto written = write(fd, data, size);
+#endif
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw std::runtime_error("Can't write frame");
+        }
+        data += written;
+        size -= std::size_t(written);
+    }
+}
+
+void FramePipeline::Check()
+{
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+} // namespace x86emu
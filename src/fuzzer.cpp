@@ -0,0 +1,77 @@
+#include "include/cpu86e/fuzzer.h"
+#include <cstring>
+
+namespace cpu86e {
+
+Fuzzer::Fuzzer(CPU &cpu, Memory &memory) :
+    cpu(&cpu),
+    memory(&memory),
+    state(cpu.State()),
+    coverage(nullptr),
+    coverageSize(0),
+    executions(0)
+{}
+
+void Fuzzer::SetCoverage(uint8_t *bitmap, size_t size)
+{
+    cpu->SetCoverage(bitmap, size);
+    coverage = bitmap;
+    coverageSize = size;
+}
+
+void Fuzzer::SetLoader(Loader argLoader)
+{
+    loader = std::move(argLoader);
+}
+
+void Fuzzer::SetInput(uint32_t addr, Register sizeReg)
+{
+    loader = [addr, sizeReg](CPUState& state, Memory& memory, const uint8_t* input, size_t size) {
+        memory.Write(addr, input, size);
+        state.gpr[sizeReg] = RegVal(size);
+    };
+}
+
+void Fuzzer::Snapshot()
+{
+    state = cpu->State();
+    memory->Save(snapshot);
+}
+
+bool Fuzzer::SnapshotAt(uint16_t cs, uint16_t ip, long long budget)
+{
+    auto& current = cpu->State();
+    for (; budget != 0; --budget) {
+        if (current.sregs[CS] == cs && current.ip == ip) {
+            Snapshot();
+            return true;
+        }
+        if (cpu->Run(1)) {
+            return false;
+        }
+    }
+    return false;
+}
+
+auto Fuzzer::Execute(const void *input, size_t size, int budget) -> Result
+{
+    memory->Restore(snapshot);
+    auto initial = state;
+    if (loader) {
+        loader(initial, *memory, static_cast<const uint8_t*>(input), size);
+    }
+    cpu->LoadState(initial);
+    if (coverage) {
+        std::memset(coverage, 0, coverageSize);
+        cpu->ResetCoverage();
+    }
+    ++executions;
+    return cpu->Run(budget) ? Halted : Timeout;
+}
+
+auto Fuzzer::Executions() const -> unsigned long long
+{
+    return executions;
+}
+
+} // namespace x86emu
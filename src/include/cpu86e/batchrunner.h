@@ -0,0 +1,50 @@
+#ifndef CPU86E_BATCHRUNNER_H
+#define CPU86E_BATCHRUNNER_H
+
+#include "cpu.h"
+#include "threadpool.h"
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace cpu86e {
+
+class BatchRunner
+{
+public:
+    enum Status {
+        Pending,
+        Halted,
+        Exhausted,
+        Failed
+    };
+    struct Instance {
+        Instance(std::unique_ptr<IIOHook> hook, const CPUState& state, long long budget);
+        std::unique_ptr<IIOHook> hook;
+        CPU cpu;
+        long long budget;
+        long long steps;
+        Status status;
+        std::exception_ptr error;
+    };
+    // Called on the worker thread that finished the instance, so calls for
+    // different instances may run concurrently.
+    using Completion = std::function<void(std::size_t id, Instance& instance)>;
+    explicit BatchRunner(unsigned threads = 0);
+    auto Add(std::unique_ptr<IIOHook> hook, long long budget = -1) -> std::size_t;
+    auto Add(std::unique_ptr<IIOHook> hook, const CPUState& state, long long budget = -1) -> std::size_t;
+    void Run(int slice = 1024, Completion onComplete = {});
+    auto Get(std::size_t id) -> Instance&;
+    auto Count() const -> std::size_t;
+    void Clear();
+private:
+    void RunSlice(std::size_t id, int slice, const Completion& onComplete);
+
+    ThreadPool pool;
+    std::vector<std::unique_ptr<Instance>> instances;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_BATCHRUNNER_H
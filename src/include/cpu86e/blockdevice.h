@@ -0,0 +1,93 @@
+#ifndef CPU86E_BLOCKDEVICE_H
+#define CPU86E_BLOCKDEVICE_H
+
+#include "cpu.h"
+#include "memory.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+namespace cpu86e {
+
+class BlockDevice
+{
+public:
+    static constexpr std::size_t SectorSize = 512;
+    enum Port {
+        Data,
+        Count,
+        Lba0,
+        Lba1,
+        Lba2,
+        Lba3,
+        Command,
+        Ports
+    };
+    enum Commands {
+        ReadSectors = 0x20,
+        WriteSectors = 0x30
+    };
+    enum Status {
+        Error = 0x01,
+        Request = 0x08,
+        Ready = 0x40
+    };
+    struct Chs {
+        uint16_t cylinders;
+        uint8_t heads;
+        uint8_t sectors;
+    };
+    BlockDevice(std::shared_ptr<const Image> image, uint32_t readAhead = 64);
+    BlockDevice(const BlockDevice&) = delete;
+    BlockDevice& operator=(const BlockDevice&) = delete;
+    ~BlockDevice();
+    auto Sectors() const -> uint32_t;
+    auto Geometry() const -> Chs;
+    void SetGeometry(Chs chs);
+    void Read(uint32_t lba, void* data, uint32_t count);
+    void Write(uint32_t lba, const void* data, uint32_t count);
+    auto Overlay() const -> std::size_t;
+    void Discard();
+    auto Prefetched() const -> uint64_t;
+    auto ReadPort(uint32_t port) -> uint8_t;
+    void WritePort(uint32_t port, uint8_t val);
+    void Attach(CPU& cpu, uint8_t drive = 0x80, uint8_t vector = 0x13);
+private:
+    auto Valid(uint32_t lba, uint32_t count) const -> bool;
+    auto Sector(uint32_t lba) const -> const uint8_t*;
+    void ReadAhead(uint32_t lba);
+    auto Interrupt(CPU& cpu, uint8_t drive) -> bool;
+    void Load();
+    void WorkerMain();
+
+    std::shared_ptr<const Image> image;
+    uint32_t sectors;
+    Chs chs;
+    std::unordered_map<uint32_t, std::unique_ptr<uint8_t[]>> overlay;
+    uint32_t lba;
+    uint8_t count;
+    uint8_t command;
+    uint8_t status;
+    uint32_t remaining;
+    std::size_t pos;
+    uint8_t buffer[SectorSize];
+    uint32_t readAhead;
+    uint32_t aheadFirst;
+    uint32_t aheadEnd;
+    std::mutex mutex;
+    std::condition_variable wake;
+    uint32_t pendingFirst;
+    uint32_t pendingEnd;
+    bool stop;
+    std::atomic<uint64_t> prefetched;
+    std::thread worker;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_BLOCKDEVICE_H
@@ -0,0 +1,25 @@
+#ifndef CPU86E_BOOTCACHE_H
+#define CPU86E_BOOTCACHE_H
+
+#include "cpu.h"
+#include "memory.h"
+#include <cstdint>
+#include <vector>
+
+namespace cpu86e {
+
+class BootCache
+{
+public:
+    using Key = std::vector<uint64_t>;
+    static auto Hash(const Memory& memory) -> Key;
+    // Folds host-side state (disk images, device configuration) into a key
+    // passed to Save/Load; a cache saved under a different key is rejected.
+    static auto HashDevice(const void* data, size_t size, uint64_t device = 0) -> uint64_t;
+    static void Save(const char* path, const Key& key, const CPU& cpu, const Memory& memory, uint64_t device = 0);
+    static bool Load(const char* path, CPU& cpu, Memory& memory, uint64_t device = 0);
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_BOOTCACHE_H
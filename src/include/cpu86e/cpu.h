@@ -4,12 +4,15 @@
 #include "iiohook.h"
 #include <cstdint>
 #include <atomic>
+#include <functional>
+#include <memory>
 
 namespace cpu86e {
 
 using std::uint8_t;
 using std::uint16_t;
 using std::uint32_t;
+using std::uint64_t;
 
 using RegVal = uint16_t;
 
@@ -51,6 +54,7 @@ public:
     auto State() -> CPUState&;
     auto State() const -> const CPUState&;
     void SetHook(IIOHook* hook);
+    auto Hook() const -> IIOHook*;
     int Run(int steps = -1);
     void Step();
     void InitInterrupt(int interrupt);
@@ -59,33 +63,105 @@ public:
     void SetNMI(int level);
     void SetHalt(int level);
     static constexpr int NoInterrupt = -1;
+    static constexpr int NonMaskable = -2;
     void SetINTR(int interrupt);
+    auto Instructions() const -> uint64_t;
+    // size must be a power of two; a null bitmap turns coverage off.
+    void SetCoverage(uint8_t* bitmap, std::size_t size);
+    void ResetCoverage();
+    // A handler that returns true replaces the whole interrupt: no frame is
+    // pushed, IF and TF are left alone and execution continues at the current
+    // IP. For INT n that is the next instruction; for a CPU exception it is
+    // the faulting instruction, which runs again unless the handler moves IP.
+    // INTR is level-triggered: a handler claiming an external vector must
+    // deassert it (SetINTR(NoInterrupt)) or it is called again on every step.
+    using Handler = std::function<bool(CPU& cpu, int vector)>;
+    void SetHandler(uint8_t vector, Handler handler);
+    void Read(uint32_t addr, void* data, size_t size);
+    void Write(uint32_t addr, const void* data, size_t size);
+    // Hypercalls are encoded as HypercallOpcode followed by a function byte and
+    // raise #UD unless enabled. Source is DS:SI (segment override honoured),
+    // destination ES:DI and length CX; buffers wrap at 1 MiB and SI, DI and CX
+    // are left unchanged. CF and ZF are cleared on entry; an unknown function
+    // sets CF.
+    //   HyperCopy:     copy CX bytes from source to destination (memmove).
+    //   HyperFill:     store AL into CX bytes at the destination.
+    //   HyperCompare:  AX = offset of the first differing byte (CX if none);
+    //                  ZF set if equal, CF set if the source byte is below.
+    //   HyperChecksum: DX:AX = CRC-32C of the source, continuing from DX:AX
+    //                  (pass 0 to start a new checksum).
+    enum Hypercall {
+        HyperCopy,
+        HyperFill,
+        HyperCompare,
+        HyperChecksum,
+    };
+    static constexpr uint8_t HypercallOpcode = 0xC8;
+    void SetHypercalls(bool enable);
 private:
     struct Prefixes;
     struct Operations;
     struct Calc;
     int DoStep();
     auto ParsePrefixes() -> Prefixes;
-    auto ReadByte(SegmentRegister sreg, uint16_t addr) -> uint8_t;
-    auto ReadWord(SegmentRegister sreg, uint16_t addr) -> uint16_t;
-    auto ReadMem(SegmentRegister sreg, uint16_t addr, int logSz) -> RegVal;
-    void WriteByte(SegmentRegister sreg, uint16_t addr, uint8_t val);
-    void WriteWord(SegmentRegister sreg, uint16_t addr, uint16_t val);
-    void WriteMem(SegmentRegister sreg, uint16_t addr, int logSz, RegVal val);
-    auto ReadByte(uint32_t addr) -> uint8_t;
-    auto ReadWord(uint32_t addr) -> uint16_t;
-    auto ReadMem(uint32_t addr, int logSz) -> RegVal;
-    void WriteByte(uint32_t addr, uint8_t val);
-    void WriteWord(uint32_t addr, uint16_t val);
-    void WriteMem(uint32_t addr, int logSz, RegVal val);
+    auto ReadByte(SegmentRegister sreg, uint16_t addr, IIOHook::Access access = IIOHook::Data) -> uint8_t;
+    auto ReadWord(SegmentRegister sreg, uint16_t addr, IIOHook::Access access = IIOHook::Data) -> uint16_t;
+    auto ReadMem(SegmentRegister sreg, uint16_t addr, int logSz, IIOHook::Access access = IIOHook::Data) -> RegVal;
+    void WriteByte(SegmentRegister sreg, uint16_t addr, uint8_t val, IIOHook::Access access = IIOHook::Data);
+    void WriteWord(SegmentRegister sreg, uint16_t addr, uint16_t val, IIOHook::Access access = IIOHook::Data);
+    void WriteMem(SegmentRegister sreg, uint16_t addr, int logSz, RegVal val, IIOHook::Access access = IIOHook::Data);
+    auto ReadByte(uint32_t addr, IIOHook::Access access = IIOHook::Data) -> uint8_t;
+    auto ReadWord(uint32_t addr, IIOHook::Access access = IIOHook::Data) -> uint16_t;
+    auto ReadMem(uint32_t addr, int logSz, IIOHook::Access access = IIOHook::Data) -> RegVal;
+    void WriteByte(uint32_t addr, uint8_t val, IIOHook::Access access = IIOHook::Data);
+    void WriteWord(uint32_t addr, uint16_t val, IIOHook::Access access = IIOHook::Data);
+    void WriteMem(uint32_t addr, int logSz, RegVal val, IIOHook::Access access = IIOHook::Data);
+    void ReadBlock(uint32_t addr, void* data, size_t size, IIOHook::Access access);
+    void WriteBlock(uint32_t addr, void* data, size_t size, IIOHook::Access access);
+    auto BulkAllowed() const -> bool;
+    auto BulkCopy(SegmentRegister sreg, int logSz, RegVal counter) -> RegVal;
+    auto BulkFill(int logSz, RegVal counter) -> RegVal;
+    auto FetchByte(uint16_t addr) -> uint8_t;
+    auto FetchWord(uint16_t addr) -> uint16_t;
+    auto Fetch(uint16_t addr, int logSz) -> RegVal;
+    void Prefetch(uint32_t addr, uint32_t size = 1);
+    void FlushFetch();
+    void Touch(uint32_t addr, size_t size);
+    void LoadSeg(int sreg, uint16_t val);
+    void LoadBases();
     auto CalcAddr(SegmentRegister sreg, uint16_t addr) -> uint32_t;
+    void Edge();
+    void Spin();
 
     CPUState state;
     IIOHook* hook;
+    uint32_t bases[8];
+    static constexpr uint32_t MinFetch = 6;
+    uint8_t window[16];
+    const uint8_t* fetch;
+    uint32_t windowAddr;
+    uint32_t windowSize;
+    static constexpr uint32_t IvtSize = 0x400;
+    const uint8_t* ivt;
+    bool ivtCached;
+    static constexpr uint32_t MaxBulk = 4096;
+    uint32_t budget;
+    uint32_t retired;
+    uint32_t writes;
+    uint32_t spinWrites;
+    uint32_t spinTarget;
+    uint64_t spinAt;
+    CPUState spinState;
     RegVal oldflags;
     std::atomic_bool nmi;
     std::atomic_bool halt;
     std::atomic_int intr;
+    uint8_t* coverage;
+    uint32_t coverageMask;
+    uint32_t prevLocation;
+    uint64_t instructions;
+    std::unique_ptr<Handler[]> handlers;
+    bool hypercalls;
 };
 
 } // namespace x86emu
@@ -0,0 +1,77 @@
+#ifndef CPU86E_DMACONTROLLER_H
+#define CPU86E_DMACONTROLLER_H
+
+#include "cpu.h"
+#include "scheduler.h"
+#include <cstddef>
+#include <cstdint>
+
+namespace cpu86e {
+
+class DmaController
+{
+public:
+    static constexpr int Channels = 4;
+    enum Port {
+        Status = 0x08,
+        Command = 0x08,
+        Request = 0x09,
+        SingleMask = 0x0A,
+        Mode = 0x0B,
+        ClearFlipFlop = 0x0C,
+        MasterClear = 0x0D,
+        ClearMask = 0x0E,
+        AllMask = 0x0F,
+        Page = 0x10,
+        Ports = Page + Channels
+    };
+    enum Transfers {
+        Verify = 0x00,
+        ToMemory = 0x04,
+        FromMemory = 0x08
+    };
+    enum ModeBits {
+        TransferMask = 0x0C,
+        AutoInit = 0x10,
+        Decrement = 0x20
+    };
+    DmaController(CPU& cpu, Scheduler& scheduler);
+    auto ReadPort(uint32_t port) -> uint8_t;
+    void WritePort(uint32_t port, uint8_t val);
+    // The completion interrupt stays asserted until the guest reads the
+    // status register or the host acknowledges the channel.
+    void SetInterrupt(int channel, int interrupt, uint64_t delay = 0);
+    void Acknowledge(int channel);
+    auto Transfer(int channel, void* data, std::size_t size) -> std::size_t;
+    auto Remaining(int channel) const -> std::size_t;
+    auto Bytes() const -> uint64_t;
+private:
+    struct Channel {
+        uint16_t baseAddress;
+        uint16_t baseCount;
+        uint16_t address;
+        uint16_t count;
+        uint8_t page;
+        uint8_t mode;
+        int interrupt;
+        uint64_t delay;
+    };
+    void Reset();
+    void Copy(Channel& channel, uint8_t* data, std::size_t size);
+    void Complete(int index);
+    void Update();
+
+    CPU* cpu;
+    Scheduler* scheduler;
+    Channel channels[Channels];
+    uint8_t mask;
+    uint8_t status;
+    bool flipFlop;
+    uint8_t pending;
+    bool asserted;
+    uint64_t bytes;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_DMACONTROLLER_H
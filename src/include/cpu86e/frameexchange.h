@@ -0,0 +1,45 @@
+#ifndef CPU86E_FRAMEEXCHANGE_H
+#define CPU86E_FRAMEEXCHANGE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace cpu86e {
+
+class FrameExchange
+{
+public:
+    static constexpr int Slots = 3;
+    explicit FrameExchange(std::size_t size);
+    FrameExchange(const FrameExchange&) = delete;
+    FrameExchange& operator=(const FrameExchange&) = delete;
+    auto Back() const -> std::uint8_t*;
+    auto Front() const -> std::uint8_t*;
+    auto Publish() -> std::uint8_t*;
+    auto Acquire() -> const std::uint8_t*;
+    void Release();
+    auto Latency() const -> std::chrono::nanoseconds;
+    auto Published() const -> std::uint64_t;
+    auto Copies() const -> std::uint64_t;
+private:
+    static constexpr int None = -1;
+    auto Slot(int index) const -> std::uint8_t*;
+
+    std::size_t size;
+    std::unique_ptr<std::uint8_t[]> storage;
+    int back;
+    int front;
+    std::atomic_int latest;
+    std::atomic_int reading;
+    std::atomic<std::int64_t> stamps[Slots];
+    std::atomic<std::int64_t> latency;
+    std::atomic<std::uint64_t> published;
+    std::atomic<std::uint64_t> copies;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_FRAMEEXCHANGE_H
@@ -0,0 +1,77 @@
+#ifndef CPU86E_FRAMEPIPELINE_H
+#define CPU86E_FRAMEPIPELINE_H
+
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cpu86e {
+
+class FramePipeline
+{
+public:
+    enum Format {
+        Rgba,
+        Rgb,
+        Ppm,
+        Y4m,
+        Delta
+    };
+    static constexpr int Width = 320;
+    static constexpr int Height = 200;
+    static constexpr std::size_t PixelCount = Width * Height;
+    static constexpr std::size_t PaletteOffset = PixelCount;
+    static constexpr std::size_t FrameSize = PaletteOffset + 256 * 4;
+    static constexpr int Span = 16;
+    enum DeltaFlags {
+        DeltaPalette = 1
+    };
+    FramePipeline(int fd, Format format, std::size_t depth = 4);
+    FramePipeline(const FramePipeline&) = delete;
+    FramePipeline& operator=(const FramePipeline&) = delete;
+    ~FramePipeline();
+    void Submit(const std::uint8_t* frame);
+    void Flush();
+    auto Frames() const -> std::uint64_t;
+    auto ChangedRows() const -> std::uint64_t;
+    static auto OutputSize(Format format) -> std::size_t;
+    static void Convert(const std::uint8_t* frame, std::uint8_t* out, Format format);
+    static auto Decode(const std::uint8_t* data, std::size_t size, std::uint8_t* frame) -> std::size_t;
+private:
+    using Rows = std::bitset<Height>;
+    static void Convert(const std::uint8_t* frame, std::uint8_t* out, Format format, const Rows& rows);
+    auto Compare(const std::uint8_t* frame) -> Rows;
+    void Encode(const std::uint8_t* frame, const Rows& rows);
+    void WorkerMain();
+    void Write(const std::uint8_t* data, std::size_t size);
+    void Check();
+
+    int fd;
+    Format format;
+    std::size_t depth;
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::condition_variable space;
+    std::deque<std::vector<std::uint8_t>> queue;
+    std::vector<std::vector<std::uint8_t>> spare;
+    std::vector<std::uint8_t> output;
+    std::vector<std::uint8_t> previous;
+    bool primed;
+    std::atomic<std::uint64_t> frames;
+    std::atomic<std::uint64_t> changedRows;
+    bool busy;
+    bool stop;
+    std::exception_ptr error;
+    std::thread worker;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_FRAMEPIPELINE_H
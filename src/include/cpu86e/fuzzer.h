@@ -0,0 +1,39 @@
+#ifndef CPU86E_FUZZER_H
+#define CPU86E_FUZZER_H
+
+#include "cpu.h"
+#include "memory.h"
+#include <functional>
+
+namespace cpu86e {
+
+class Fuzzer
+{
+public:
+    enum Result {
+        Halted,
+        Timeout
+    };
+    using Loader = std::function<void(CPUState& state, Memory& memory, const uint8_t* input, size_t size)>;
+    Fuzzer(CPU& cpu, Memory& memory);
+    void SetCoverage(uint8_t* bitmap, size_t size);
+    void SetLoader(Loader loader);
+    void SetInput(uint32_t addr, Register sizeReg = CX);
+    void Snapshot();
+    bool SnapshotAt(uint16_t cs, uint16_t ip, long long budget);
+    auto Execute(const void* input, size_t size, int budget) -> Result;
+    auto Executions() const -> unsigned long long;
+private:
+    CPU* cpu;
+    Memory* memory;
+    Loader loader;
+    CPUState state;
+    Memory::Snapshot snapshot;
+    uint8_t* coverage;
+    size_t coverageSize;
+    unsigned long long executions;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_FUZZER_H
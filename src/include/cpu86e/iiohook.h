@@ -9,18 +9,55 @@ namespace cpu86e {
 using std::uint8_t;
 using std::uint16_t;
 using std::uint32_t;
+using std::uint64_t;
 using std::size_t;
 
 struct CPUState;
 
+struct HostSpan
+{
+    uint8_t* data = nullptr;
+    size_t size = 0;
+};
+
 struct IIOHook
 {
+    enum Access {
+        Fetch,
+        Data,
+        Stack,
+        String
+    };
     virtual void ReadMem(CPUState& state, void* data, size_t size, uint32_t addr) = 0;
     virtual void WriteMem(CPUState& state, uint32_t addr, void* data, size_t size) = 0;
     virtual auto ReadIOByte(uint32_t addr) -> uint8_t = 0;
     virtual auto ReadIOWord(uint32_t addr) -> uint16_t = 0;
     virtual void WriteIOByte(uint32_t addr, uint8_t val) = 0;
     virtual void WriteIOWord(uint32_t addr, uint16_t val) = 0;
+    virtual void AcceptInterrupt(int interrupt) {}
+    // Fetch reads may run ahead of the instruction being decoded, up to the
+    // end of the code segment or of the 4 KiB page. Hooks that map devices
+    // in code-reachable pages must not trigger read side effects for them.
+    virtual void ReadBlock(CPUState& state, void* data, size_t size, uint32_t addr, Access access)
+    {
+        ReadMem(state, data, size, addr);
+    }
+    virtual void WriteBlock(CPUState& state, uint32_t addr, void* data, size_t size, Access access)
+    {
+        WriteMem(state, addr, data, size);
+    }
+    virtual auto Direct(uint32_t addr, bool write) -> HostSpan
+    {
+        return {};
+    }
+    // Called by CPU::Write before the host stores into guest memory, e.g.
+    // for a DMA transfer or a native interrupt handler filling a buffer.
+    virtual void HostWrite(uint32_t addr, const void* data, size_t size)
+    {}
+    virtual auto StableUntil(uint64_t since) -> uint64_t
+    {
+        return since;
+    }
 };
 
 } // namespace x86emu
@@ -0,0 +1,46 @@
+#ifndef CPU86E_LOCKSTEP_H
+#define CPU86E_LOCKSTEP_H
+
+#include "cpu.h"
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace cpu86e {
+
+// Runs many guests that execute the same program. Lanes sharing CS:IP
+// execute register-only ALU and branch instructions together over a
+// structure-of-arrays register file; everything else, and lanes that
+// lag behind the group for too long, go through the scalar CPU.
+// Code bytes are fetched from the group leader only, and only as many
+// as the vector decoder consumes.
+class Lockstep
+{
+public:
+    Lockstep();
+    ~Lockstep();
+    auto AddLane(IIOHook& hook, const CPUState& state) -> std::size_t;
+    auto Run(int steps = -1) -> std::size_t;
+    void StoreState(std::size_t lane, CPUState& state) const;
+    bool Halted(std::size_t lane) const;
+    auto Steps(std::size_t lane) const -> long long;
+    auto Lanes() const -> std::size_t;
+    static constexpr int PeelAge = 64;
+private:
+    struct Lane;
+    bool Tick();
+    bool StepVector(const uint8_t* code);
+    void StepScalar(std::size_t lane);
+    bool FetchCode(std::size_t lane, uint8_t* code);
+
+    std::vector<RegVal> gpr[8];
+    std::vector<RegVal> ip;
+    std::vector<RegVal> flags;
+    std::vector<uint16_t> sregs[6];
+    std::vector<uint8_t> mask;
+    std::vector<std::unique_ptr<Lane>> lanes;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_LOCKSTEP_H
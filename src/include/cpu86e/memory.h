@@ -0,0 +1,118 @@
+#ifndef CPU86E_MEMORY_H
+#define CPU86E_MEMORY_H
+
+#include "iiohook.h"
+#include <cstddef>
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace cpu86e {
+
+using std::uint8_t;
+using std::uint32_t;
+using std::size_t;
+
+class MappedFile
+{
+public:
+    MappedFile();
+    MappedFile(const char* path, bool writable);
+    MappedFile(MappedFile&& other);
+    MappedFile& operator=(MappedFile&& other);
+    ~MappedFile();
+    auto Data() const -> uint8_t*;
+    auto Size() const -> size_t;
+    auto FileSize() const -> size_t;
+private:
+    void Close();
+
+    uint8_t* data;
+    size_t size;
+    size_t fileSize;
+};
+
+class Image
+{
+public:
+    static auto FromFile(const char* path) -> std::shared_ptr<const Image>;
+    static auto FromBuffer(std::vector<uint8_t> data) -> std::shared_ptr<const Image>;
+    static auto Map(const char* path) -> std::shared_ptr<const Image>;
+    auto Data() const -> const uint8_t*;
+    auto Size() const -> size_t;
+private:
+    Image(std::vector<uint8_t> data, size_t size);
+    Image(MappedFile file);
+
+    std::vector<uint8_t> storage;
+    MappedFile file;
+    const uint8_t* data;
+    size_t size;
+};
+
+class Memory
+{
+public:
+    static constexpr uint32_t AddressSize = 0x100000;
+    static constexpr int PageBits = 12;
+    static constexpr uint32_t PageSize = 1 << PageBits;
+    static constexpr uint32_t PageCount = AddressSize / PageSize;
+    using PageSet = std::bitset<PageCount>;
+    class Snapshot;
+    Memory();
+    Memory(const Memory&) = delete;
+    Memory& operator=(const Memory&) = delete;
+    void MapRam(uint32_t addr, uint32_t size);
+    void MapRam(uint32_t addr, uint8_t* host, uint32_t size);
+    void MapRom(uint32_t addr, const uint8_t* host, uint32_t size);
+    void MapImage(uint32_t addr, std::shared_ptr<const Image> image, size_t offset, uint32_t size, bool writable = true);
+    void MapFile(uint32_t addr, const char* path, uint32_t size, bool writable = true);
+    void Unmap(uint32_t addr, uint32_t size);
+    void Read(void* data, size_t size, uint32_t addr) const;
+    void Write(uint32_t addr, const void* data, size_t size);
+    auto Direct(uint32_t addr, bool write) -> HostSpan;
+    auto PrivatePages() const -> size_t;
+    void Save(Snapshot& snapshot);
+    // A snapshot may be restored into another Memory with the same layout.
+    // Saved page contents are copied into this instance's own RAM or owned pages.
+    void Restore(const Snapshot& snapshot);
+    void MarkDirty(uint32_t addr, size_t size);
+    auto Dirty() const -> const PageSet&;
+    void ClearDirty();
+private:
+    enum Kind : uint8_t {
+        Unmapped,
+        Ram,
+        Rom,
+        Cow
+    };
+    struct Page {
+        const uint8_t* read;
+        uint8_t* write;
+        Kind kind;
+        bool operator==(const Page&) const = default;
+    };
+    void SetPage(uint32_t index, Kind kind, const uint8_t* read, uint8_t* write);
+    auto CopyOnWrite(uint32_t index) -> uint8_t*;
+
+    Page pages[PageCount];
+    std::unique_ptr<uint8_t[]> owned[PageCount];
+    std::vector<std::shared_ptr<const Image>> images;
+    std::vector<MappedFile> files;
+    PageSet dirty;
+};
+
+class Memory::Snapshot
+{
+    friend class Memory;
+    static constexpr uint32_t NoData = -1;
+    Page pages[PageCount];
+    uint32_t offsets[PageCount];
+    PageSet owned;
+    std::vector<uint8_t> data;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_MEMORY_H
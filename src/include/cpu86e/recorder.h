@@ -0,0 +1,115 @@
+#ifndef CPU86E_RECORDER_H
+#define CPU86E_RECORDER_H
+
+#include "cpu.h"
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace cpu86e {
+
+struct Recording
+{
+    enum Event : uint8_t {
+        IOByte,
+        IOWord,
+        Mmio,
+        Interrupt,
+        NMI,
+        End,
+        Write
+    };
+    CPUState initial;
+    uint64_t start;
+    std::vector<uint8_t> events;
+    void Save(const char* path) const;
+    static auto Load(const char* path) -> Recording;
+};
+
+class MmioRanges
+{
+public:
+    void AddMmio(uint32_t addr, uint32_t size);
+protected:
+    bool IsMmio(uint32_t addr, size_t size) const;
+    auto Clip(uint32_t addr, size_t size) const -> size_t;
+private:
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+};
+
+// Host writes made through CPU::Write are logged with their payload and
+// replayed at the same instruction count. Native interrupt handlers are
+// not recorded; the replaying CPU needs the same handlers installed.
+class Recorder : public IIOHook, public MmioRanges
+{
+public:
+    explicit Recorder(IIOHook& inner);
+    void Start(CPU& cpu);
+    auto Finish() -> Recording;
+
+    void ReadMem(CPUState& state, void* data, size_t size, uint32_t addr) override;
+    void WriteMem(CPUState& state, uint32_t addr, void* data, size_t size) override;
+    auto ReadIOByte(uint32_t addr) -> uint8_t override;
+    auto ReadIOWord(uint32_t addr) -> uint16_t override;
+    void WriteIOByte(uint32_t addr, uint8_t val) override;
+    void WriteIOWord(uint32_t addr, uint16_t val) override;
+    void AcceptInterrupt(int interrupt) override;
+    auto Direct(uint32_t addr, bool write) -> HostSpan override;
+    void HostWrite(uint32_t addr, const void* data, size_t size) override;
+private:
+    void Put(Recording::Event event);
+
+    IIOHook* inner;
+    const CPU* cpu;
+    Recording recording;
+    uint64_t last;
+};
+
+class Replayer : public IIOHook, public MmioRanges
+{
+public:
+    struct Position {
+        uint64_t instructions;
+        size_t pos;
+        uint64_t when;
+        Recording::Event event;
+    };
+    Replayer(IIOHook& memory, Recording recording);
+    Replayer(IIOHook& memory, std::shared_ptr<const Recording> recording);
+    auto Initial() const -> const CPUState&;
+    auto Run(CPU& cpu, long long steps = -1) -> int;
+    bool Finished() const;
+    bool Pending(const CPU& cpu) const;
+    auto Tell(const CPU& cpu) const -> Position;
+    void Seek(const CPU& cpu, const Position& position);
+
+    void ReadMem(CPUState& state, void* data, size_t size, uint32_t addr) override;
+    void WriteMem(CPUState& state, uint32_t addr, void* data, size_t size) override;
+    auto ReadIOByte(uint32_t addr) -> uint8_t override;
+    auto ReadIOWord(uint32_t addr) -> uint16_t override;
+    void WriteIOByte(uint32_t addr, uint8_t val) override;
+    void WriteIOWord(uint32_t addr, uint16_t val) override;
+    void AcceptInterrupt(int interrupt) override;
+    auto Direct(uint32_t addr, bool write) -> HostSpan override;
+    void HostWrite(uint32_t addr, const void* data, size_t size) override;
+private:
+    void Next();
+    void ApplyWrite(CPU& cpu);
+    auto Take(Recording::Event event) -> const uint8_t*;
+
+    static constexpr uint64_t NotStarted = ~uint64_t(0);
+
+    IIOHook* memory;
+    const CPU* cpu;
+    std::shared_ptr<const Recording> recording;
+    size_t pos;
+    uint64_t origin;
+    uint64_t when;
+    Recording::Event event;
+    bool finished;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_RECORDER_H
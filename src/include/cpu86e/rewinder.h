@@ -0,0 +1,63 @@
+#ifndef CPU86E_REWINDER_H
+#define CPU86E_REWINDER_H
+
+#include "cpu.h"
+#include "memory.h"
+#include "recorder.h"
+#include <chrono>
+#include <deque>
+#include <vector>
+
+namespace cpu86e {
+
+class Rewinder
+{
+public:
+    static constexpr uint64_t MinInterval = 4096;
+    Rewinder(CPU& cpu, Memory& memory, Replayer* replayer = nullptr);
+    void SetCapacity(std::size_t frames);
+    void SetOverhead(double fraction);
+    void Start();
+    auto Run(long long steps = -1) -> int;
+    auto Now() const -> uint64_t;
+    auto Oldest() const -> uint64_t;
+    auto Interval() const -> uint64_t;
+    bool Seek(uint64_t instructions);
+    bool StepBack(uint64_t steps = 1);
+    bool RunBackToWrite(uint32_t addr, size_t size = 1);
+private:
+    struct Frame {
+        static constexpr uint32_t NoData = -1;
+        uint64_t instructions;
+        CPUState state;
+        Replayer::Position position;
+        Memory::PageSet pages;
+        uint32_t offsets[Memory::PageCount];
+        std::vector<uint8_t> data;
+    };
+    class WriteWatch;
+    auto Advance(uint64_t steps) -> int;
+    bool Safe() const;
+    void Snapshot(bool all);
+    void Capture(bool all);
+    void Fold();
+    void Restore(std::size_t frame);
+    void Discard();
+    void Truncate();
+    auto Changed(std::size_t frame) const -> Memory::PageSet;
+
+    CPU* cpu;
+    Memory* memory;
+    Replayer* replayer;
+    std::deque<Frame> frames;
+    std::size_t current;
+    std::size_t capacity;
+    double overhead;
+    uint64_t interval;
+    uint64_t origin;
+    std::chrono::steady_clock::duration running;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_REWINDER_H
@@ -0,0 +1,42 @@
+#ifndef CPU86E_SCHEDULER_H
+#define CPU86E_SCHEDULER_H
+
+#include "cpu.h"
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+namespace cpu86e {
+
+class Scheduler
+{
+public:
+    using Callback = std::function<void(uint64_t now)>;
+    static constexpr uint64_t Never = ~uint64_t(0);
+    Scheduler();
+    auto Now(const CPU& cpu) const -> uint64_t;
+    auto Schedule(uint64_t when, Callback callback) -> uint64_t;
+    void Cancel(uint64_t id);
+    auto Next() const -> uint64_t;
+    auto StableUntil(uint64_t since) const -> uint64_t;
+    int Run(CPU& cpu, uint64_t until, int slice = 1024);
+private:
+    struct Event {
+        uint64_t when;
+        uint64_t id;
+    };
+    static bool Later(const Event& a, const Event& b);
+    void Dispatch(const CPU& cpu);
+    void Prune();
+
+    std::vector<Event> queue;
+    std::unordered_map<uint64_t, Callback> callbacks;
+    uint64_t nextId;
+    uint64_t idle;
+    uint64_t dispatched;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_SCHEDULER_H
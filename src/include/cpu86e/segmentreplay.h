@@ -0,0 +1,47 @@
+#ifndef CPU86E_SEGMENTREPLAY_H
+#define CPU86E_SEGMENTREPLAY_H
+
+#include "cpu.h"
+#include "memory.h"
+#include "recorder.h"
+#include "threadpool.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace cpu86e {
+
+class SegmentReplay : public MmioRanges
+{
+public:
+    struct Checkpoint {
+        uint64_t instructions;
+        CPUState state;
+        Replayer::Position position;
+        std::shared_ptr<const Memory::Snapshot> memory;
+        uint64_t hash;
+    };
+    using Machine = std::function<void(Memory& memory)>;
+    using Analysis = std::function<void(std::size_t segment, CPU& cpu, Memory& memory, Replayer& replayer, long long steps)>;
+    SegmentReplay(std::shared_ptr<const Recording> recording, Machine machine, unsigned threads = 0);
+    void Prepare(uint64_t interval);
+    auto Checkpoints() const -> const std::vector<Checkpoint>&;
+    auto Segments() const -> std::size_t;
+    void Replay(std::size_t segment, const Analysis& analysis);
+    void Analyse(const Analysis& analysis);
+    auto Verify() -> std::vector<std::size_t>;
+private:
+    struct Hook;
+    auto Capture(CPU& cpu, Memory& memory, Replayer& replayer) -> Checkpoint;
+    static auto Hash(const CPUState& state, const Memory& memory) -> uint64_t;
+
+    std::shared_ptr<const Recording> recording;
+    Machine machine;
+    std::unique_ptr<Memory> base;
+    ThreadPool pool;
+    std::vector<Checkpoint> checkpoints;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_SEGMENTREPLAY_H
@@ -0,0 +1,50 @@
+#ifndef CPU86E_THREADPOOL_H
+#define CPU86E_THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace cpu86e {
+
+class ThreadPool
+{
+public:
+    using Task = std::function<void()>;
+    explicit ThreadPool(unsigned threads = 0);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+    void Submit(Task task);
+    void Wait();
+    auto Size() const -> unsigned;
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    void WorkerMain(unsigned index);
+    bool PopLocal(unsigned index, Task& task);
+    bool Steal(unsigned index, Task& task);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    // Signed: a thief can pop a task and decrement before Submit increments.
+    std::atomic_ptrdiff_t queued;
+    std::size_t pending;
+    std::atomic_uint next;
+    bool stop;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_THREADPOOL_H
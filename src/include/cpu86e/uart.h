@@ -0,0 +1,88 @@
+#ifndef CPU86E_UART_H
+#define CPU86E_UART_H
+
+#include "cpu.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace cpu86e {
+
+class Uart
+{
+public:
+    enum Port {
+        Data,
+        InterruptEnable,
+        InterruptId,
+        LineControl,
+        ModemControl,
+        LineStatus,
+        ModemStatus,
+        Scratch,
+        Ports
+    };
+    static constexpr std::size_t Fifo = 16;
+    enum LineStatusBits {
+        DataReady = 0x01,
+        HoldingEmpty = 0x20,
+        TransmitterEmpty = 0x40
+    };
+    enum InterruptBits {
+        ReceiveInterrupt = 0x01,
+        TransmitInterrupt = 0x02
+    };
+    explicit Uart(int fd, std::size_t ring = 1 << 16);
+    Uart(const Uart&) = delete;
+    Uart& operator=(const Uart&) = delete;
+    ~Uart();
+    auto ReadPort(uint32_t port) -> uint8_t;
+    void WritePort(uint32_t port, uint8_t val);
+    auto Receive(const void* data, std::size_t size) -> std::size_t;
+    void SetInterrupt(CPU& cpu, int interrupt);
+    void Flush();
+    auto Transmitted() const -> uint64_t;
+    auto Writes() const -> uint64_t;
+private:
+    void Transmit(uint8_t val);
+    auto Identify() -> uint8_t;
+    void Update();
+    void WorkerMain();
+    void Write(const uint8_t* data, std::size_t size);
+
+    int fd;
+    std::size_t size;
+    std::unique_ptr<uint8_t[]> ring;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    uint8_t receive[Fifo];
+    std::size_t received;
+    uint16_t divisor;
+    uint8_t enable;
+    uint8_t lineControl;
+    uint8_t modemControl;
+    uint8_t scratch;
+    bool fifo;
+    bool holdingPending;
+    CPU* cpu;
+    int interrupt;
+    bool asserted;
+    std::mutex registerMutex;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable drained;
+    bool flushing;
+    bool stop;
+    std::exception_ptr error;
+    std::atomic<uint64_t> writes;
+    std::thread worker;
+};
+
+} // namespace x86emu
+
+#endif // CPU86E_UART_H
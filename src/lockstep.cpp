@@ -0,0 +1,558 @@
+#include "include/cpu86e/lockstep.h"
+#include <cstring>
+
+namespace cpu86e {
+
+namespace {
+
+enum Flags {
+    CF = 1,
+    PF = 4,
+    AF = 16,
+    ZF = 64,
+    SF = 128,
+    TF = 0x100,
+    IF = 0x200,
+    DF = 0x400,
+    OF = 0x800,
+    FlagsMask = CF | PF | AF | ZF | SF | OF
+};
+
+enum Op { Add, Or, Adc, Sbb, And, Sub, Xor, Cmp };
+
+constexpr int MaxCode = 4;
+
+inline auto SignExtend(RegVal in, int logSz) -> RegVal
+{
+    auto smask = 1 << ((8 << logSz) - 1);
+    auto mask = 2 * smask - 1;
+    return ((in & mask) ^ smask) - smask;
+}
+
+inline auto GetParity(RegVal val) -> RegVal
+{
+    val &= 0xFF;
+    val = (val & 0xF) ^ ((val & 0xF0) >> 4);
+    val = (val & 0x3) ^ ((val & 0xC) >> 2);
+    return (val & 0x1) ^ ((val & 0x2) >> 1) ^ 1;
+}
+
+inline void Invert(RegVal (&n)[2], bool inverse)
+{
+    n[0] = RegVal(n[0] ^ (RegVal(inverse) - 1));
+    n[1] = RegVal(n[1] ^ -RegVal(inverse));
+}
+
+inline auto Below(RegVal a, RegVal b, RegVal c) -> RegVal
+{
+    return RegVal(a < b) | (c & RegVal(a == b));
+}
+
+template <Op op>
+inline auto Alu(int logSz, bool inverse, RegVal n0, RegVal n1, RegVal cf, RegVal& result) -> RegVal
+{
+    RegVal n[2] = { SignExtend(n0, logSz), SignExtend(n1, logSz) };
+    RegVal flags = 0;
+    RegVal c = 0;
+    bool arith = true;
+    switch (op) {
+    case Add:
+        result = n[0] + n[1];
+        break;
+    case Adc:
+        result = n[0] + n[1] + cf;
+        c = cf;
+        break;
+    case Sbb:
+        Invert(n, inverse);
+        result = ~(n[0] + n[1] + cf);
+        c = cf;
+        break;
+    case Sub:
+    case Cmp:
+        Invert(n, inverse);
+        result = ~(n[0] + n[1]);
+        break;
+    case Or:
+        result = n[0] | n[1];
+        arith = false;
+        break;
+    case And:
+        result = n[0] & n[1];
+        arith = false;
+        break;
+    case Xor:
+        result = n[0] ^ n[1];
+        arith = false;
+        break;
+    }
+    if (arith) {
+        RegVal a = ~n[0];
+        RegVal b = n[1];
+        auto carry = Below(a, b, c);
+        RegVal mask = (0x80 << ((8 << logSz) - 8)) - 1;
+        auto ovf = Below(a & mask, b & mask, c) ^ carry;
+        auto af = Below(a & 0xF, b & 0xF, c);
+        flags |= carry * CF | ovf * OF | af * AF;
+    }
+    flags |= PF * GetParity(result) | ZF * RegVal(result == 0) | SF * ((result >> ((8 << logSz) - 1)) & 1);
+    return flags;
+}
+
+inline auto MergeFlags(RegVal f, RegVal flags, RegVal flagsMask) -> RegVal
+{
+    return f ^ ((f ^ flags) & flagsMask);
+}
+
+// Evaluates all eight conditions at once so that selecting one is a
+// shift by a value that is the same for every lane.
+inline auto Conditions(RegVal flags) -> RegVal
+{
+    RegVal of = (flags >> 11) & 1;
+    RegVal cf = flags & 1;
+    RegVal zf = (flags >> 6) & 1;
+    RegVal sf = (flags >> 7) & 1;
+    RegVal pf = (flags >> 2) & 1;
+    RegVal lt = of ^ sf;
+    return RegVal(of | cf << 1 | zf << 2 | (cf | zf) << 3 | sf << 4 | pf << 5 | lt << 6 | ((lt | zf) ^ 1) << 7);
+}
+
+inline auto Condition(RegVal flags, int cc) -> RegVal
+{
+    return RegVal(((Conditions(flags) >> ((cc >> 1) & 7)) ^ cc) & 1);
+}
+
+}
+
+struct Lockstep::Lane {
+    Lane(IIOHook& hook, const CPUState& state) :
+        hook(&hook),
+        cpu(state, hook),
+        halted(false),
+        peeled(false),
+        age(0),
+        steps(0)
+    {}
+
+    IIOHook* hook;
+    CPU cpu;
+    bool halted;
+    bool peeled;
+    int age;
+    long long steps;
+};
+
+namespace {
+
+struct RegRef {
+    RegVal* r;
+    int shift;
+    RegVal mask;
+};
+
+// Lane loops compute every lane and blend the result in with the mask,
+// so they contain no per-lane branches and the compiler can vectorize
+// them.
+template <class F>
+inline void ForLanes(std::size_t count, const uint8_t* mask, F&& f)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        f(i, mask[i]);
+    }
+}
+
+inline auto Select(uint8_t m, RegVal a, RegVal b) -> RegVal
+{
+    return RegVal(b ^ ((a ^ b) & RegVal(-m)));
+}
+
+inline auto Read(const RegRef& ref, std::size_t i) -> RegVal
+{
+    return RegVal((ref.r[i] & ref.mask) >> ref.shift);
+}
+
+inline void Write(const RegRef& ref, std::size_t i, RegVal val, uint8_t m)
+{
+    auto old = ref.r[i];
+    ref.r[i] = Select(m, RegVal((old & ~ref.mask) | ((val << ref.shift) & ref.mask)), old);
+}
+
+struct Operand {
+    RegRef ref;
+    bool isImm;
+    RegVal imm;
+};
+
+inline auto Reg(std::vector<RegVal>* gpr, int reg, int logSz) -> Operand
+{
+    if (logSz) {
+        return { { gpr[reg].data(), 0, 0xFFFF }, false, 0 };
+    }
+    return { { gpr[reg & 3].data(), (reg & 4) * 2, RegVal(0xFF << ((reg & 4) * 2)) }, false, 0 };
+}
+
+inline auto Imm(RegVal imm) -> Operand
+{
+    return { { nullptr, 0, 0 }, true, imm };
+}
+
+template <bool isImm>
+inline auto Read(const Operand& op, std::size_t i) -> RegVal
+{
+    if constexpr (isImm) {
+        return op.imm;
+    } else {
+        return Read(op.ref, i);
+    }
+}
+
+template <Op op, bool imm0, bool imm1>
+void AluLanes(std::size_t count, const uint8_t* mask, RegVal* flags, int logSz, bool inverse,
+              Operand n0, Operand n1, RegRef dst, RegVal flagsMask)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        RegVal result;
+        auto f = Alu<op>(logSz, inverse, Read<imm0>(n0, i), Read<imm1>(n1, i), flags[i] & CF, result);
+        auto m = mask[i];
+        flags[i] = Select(m, MergeFlags(flags[i], f, flagsMask), flags[i]);
+        if constexpr (op != Cmp) {
+            Write(dst, i, result, m);
+        }
+    }
+}
+
+template <Op op>
+void AluLanes(std::size_t count, const uint8_t* mask, RegVal* flags, int logSz, bool inverse,
+              const Operand& n0, const Operand& n1, const RegRef& dst, RegVal flagsMask)
+{
+    if (n0.isImm) {
+        AluLanes<op, true, false>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    } else if (n1.isImm) {
+        AluLanes<op, false, true>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    } else {
+        AluLanes<op, false, false>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    }
+}
+
+void AluLanes(Op op, std::size_t count, const uint8_t* mask, RegVal* flags, int logSz, bool inverse,
+              const Operand& n0, const Operand& n1, const RegRef& dst, RegVal flagsMask)
+{
+    switch (op) {
+    case Add:
+        return AluLanes<Add>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case Or:
+        return AluLanes<Or>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case Adc:
+        return AluLanes<Adc>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case Sbb:
+        return AluLanes<Sbb>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case And:
+        return AluLanes<And>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case Sub:
+        return AluLanes<Sub>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case Xor:
+        return AluLanes<Xor>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    case Cmp:
+        return AluLanes<Cmp>(count, mask, flags, logSz, inverse, n0, n1, dst, flagsMask);
+    }
+}
+
+// Number of code bytes StepVector decodes for op, or 0 if the
+// instruction always goes through the scalar CPU.
+auto CodeLength(uint8_t op) -> int
+{
+    if (op < 0x40 && (op & 7) < 4) {
+        return 2;
+    }
+    if (op < 0x40 && (op & 7) < 6) {
+        return 2 + (op & 1);
+    }
+    if ((op >= 0x40 && op < 0x50) || op == 0x90 || op == 0xF5 || (op >= 0xF8 && op < 0xFE)) {
+        return 1;
+    }
+    if ((op >= 0x70 && op < 0x80) || (op >= 0x88 && op < 0x8C) || (op >= 0xE0 && op < 0xE3) || op == 0xEB) {
+        return 2;
+    }
+    if (op >= 0x80 && op < 0x84) {
+        return 3 + ((op & 3) == 1);
+    }
+    if (op >= 0xB0 && op < 0xC0) {
+        return 2 + !!(op & 8);
+    }
+    if (op == 0xE9) {
+        return 3;
+    }
+    return 0;
+}
+
+}
+
+Lockstep::Lockstep() = default;
+
+Lockstep::~Lockstep() = default;
+
+auto Lockstep::AddLane(IIOHook& hook, const CPUState& state) -> std::size_t
+{
+    for (int i = 0; i < 8; ++i) {
+        gpr[i].push_back(state.gpr[i]);
+    }
+    for (int i = 0; i < 6; ++i) {
+        sregs[i].push_back(state.sregs[i]);
+    }
+    ip.push_back(state.ip);
+    flags.push_back(state.flags);
+    mask.push_back(0);
+    lanes.push_back(std::make_unique<Lane>(hook, state));
+    return lanes.size() - 1;
+}
+
+auto Lockstep::Run(int steps) -> std::size_t
+{
+    while (steps == -1 || steps-- > 0) {
+        if (!Tick()) {
+            break;
+        }
+    }
+    std::size_t running = 0;
+    for (auto& lane : lanes) {
+        running += !lane->halted;
+    }
+    return running;
+}
+
+void Lockstep::StoreState(std::size_t lane, CPUState& state) const
+{
+    for (int i = 0; i < 8; ++i) {
+        state.gpr[i] = gpr[i][lane];
+    }
+    for (int i = 0; i < 6; ++i) {
+        state.sregs[i] = sregs[i][lane];
+    }
+    state.ip = ip[lane];
+    state.flags = flags[lane];
+}
+
+bool Lockstep::Halted(std::size_t lane) const
+{
+    return lanes[lane]->halted;
+}
+
+auto Lockstep::Steps(std::size_t lane) const -> long long
+{
+    return lanes[lane]->steps;
+}
+
+auto Lockstep::Lanes() const -> std::size_t
+{
+    return lanes.size();
+}
+
+bool Lockstep::Tick()
+{
+    auto count = lanes.size();
+    std::size_t leader = count;
+    uint32_t leaderAddr = 0;
+    for (std::size_t i = 0; i < count; ++i) {
+        auto& lane = *lanes[i];
+        if (lane.halted || lane.peeled) {
+            continue;
+        }
+        uint32_t addr = sregs[CS][i] * 0x10 + ip[i];
+        if (leader == count || addr < leaderAddr) {
+            leader = i;
+            leaderAddr = addr;
+        }
+    }
+    bool any = false;
+    for (std::size_t i = 0; i < count; ++i) {
+        auto& lane = *lanes[i];
+        bool member = leader != count && !lane.halted &&
+            sregs[CS][i] == sregs[CS][leader] && ip[i] == ip[leader] && !(flags[i] & TF);
+        mask[i] = member;
+        if (member) {
+            lane.peeled = false;
+            lane.age = 0;
+        } else if (!lane.halted && !lane.peeled && ++lane.age > PeelAge) {
+            lane.peeled = true;
+        }
+        any |= !lane.halted;
+    }
+    if (!any) {
+        return false;
+    }
+    if (leader != count) {
+        uint8_t code[MaxCode];
+        if (FetchCode(leader, code) && StepVector(code)) {
+            for (std::size_t i = 0; i < count; ++i) {
+                lanes[i]->steps += mask[i];
+            }
+        } else {
+            for (std::size_t i = 0; i < count; ++i) {
+                if (mask[i]) {
+                    StepScalar(i);
+                }
+            }
+        }
+    }
+    for (std::size_t i = 0; i < count; ++i) {
+        if (lanes[i]->peeled && !lanes[i]->halted) {
+            StepScalar(i);
+        }
+    }
+    return true;
+}
+
+bool Lockstep::StepVector(const uint8_t* code)
+{
+    auto count = lanes.size();
+    auto m = mask.data();
+    auto f = flags.data();
+    auto op = code[0];
+    int length;
+    if (op < 0x40 && (op & 7) < 4) {
+        auto modRM = code[1];
+        if ((modRM & 0xC0) != 0xC0) {
+            return false;
+        }
+        int logSz = op & 1;
+        bool inverse = op & 2;
+        auto rm = Reg(gpr, modRM & 7, logSz);
+        auto reg = Reg(gpr, (modRM >> 3) & 7, logSz);
+        auto dst = inverse ? reg.ref : rm.ref;
+        AluLanes(Op((op >> 3) & 7), count, m, f, logSz, inverse, rm, reg, dst, FlagsMask);
+        length = 2;
+    } else if (op < 0x40 && (op & 7) < 6) {
+        int logSz = op & 1;
+        RegVal imm = logSz ? code[1] | code[2] << 8 : code[1];
+        auto ax = Reg(gpr, AX, logSz);
+        AluLanes(Op((op >> 3) & 7), count, m, f, logSz, true, Imm(imm), ax, ax.ref, FlagsMask);
+        length = 2 + logSz;
+    } else if (op >= 0x40 && op < 0x50) {
+        auto r = Reg(gpr, op & 7, 1);
+        AluLanes(op & 8 ? Sub : Add, count, m, f, 1, false, r, Imm(1), r.ref, FlagsMask & ~CF);
+        length = 1;
+    } else if (op >= 0x70 && op < 0x80) {
+        RegVal off = SignExtend(code[1], 0);
+        ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+            ip[i] = RegVal(ip[i] + mi * (2 + off * Condition(f[i], op)));
+        });
+        return true;
+    } else if (op >= 0x80 && op < 0x84) {
+        auto modRM = code[1];
+        if ((modRM & 0xC0) != 0xC0) {
+            return false;
+        }
+        int logSz = op & 1;
+        int immSz = (op & 3) == 1;
+        RegVal imm = immSz ? code[2] | code[3] << 8 : code[2];
+        auto rm = Reg(gpr, modRM & 7, logSz);
+        AluLanes(Op((modRM >> 3) & 7), count, m, f, logSz, false, rm, Imm(imm), rm.ref, FlagsMask);
+        length = 3 + immSz;
+    } else if (op >= 0x88 && op < 0x8C) {
+        auto modRM = code[1];
+        if ((modRM & 0xC0) != 0xC0) {
+            return false;
+        }
+        int logSz = op & 1;
+        auto rm = Reg(gpr, modRM & 7, logSz);
+        auto reg = Reg(gpr, (modRM >> 3) & 7, logSz);
+        auto dst = op & 2 ? reg : rm;
+        auto src = op & 2 ? rm : reg;
+        ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+            Write(dst.ref, i, Read(src.ref, i), mi);
+        });
+        length = 2;
+    } else if (op == 0x90) {
+        length = 1;
+    } else if (op >= 0xB0 && op < 0xC0) {
+        int logSz = !!(op & 8);
+        RegVal imm = logSz ? code[1] | code[2] << 8 : code[1];
+        auto r = Reg(gpr, op & 7, logSz);
+        ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+            Write(r.ref, i, imm, mi);
+        });
+        length = 2 + logSz;
+    } else if (op >= 0xE0 && op < 0xE3) {
+        RegVal off = SignExtend(code[1], 0);
+        auto& cx = gpr[CX];
+        RegVal flip = (op & 1) ^ 1;
+        RegVal always = (op >> 1) & 1;
+        ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+            RegVal c = RegVal(cx[i] - mi);
+            cx[i] = c;
+            RegVal taken = RegVal(c != 0) & ((((f[i] >> 6) & 1) ^ flip) | always);
+            ip[i] = RegVal(ip[i] + mi * (2 + off * taken));
+        });
+        return true;
+    } else if (op == 0xE9 || op == 0xEB) {
+        int logSz = !(op & 2);
+        RegVal off = logSz ? code[1] | code[2] << 8 : SignExtend(code[1], 0);
+        ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+            ip[i] = RegVal(ip[i] + mi * (2 + logSz + off));
+        });
+        return true;
+    } else if (op == 0xF5 || (op >= 0xF8 && op < 0xFE)) {
+        static const RegVal bits[] = { CF, CF, IF, IF, DF, DF };
+        RegVal flip = op == 0xF5 ? RegVal(CF) : 0;
+        RegVal clear = op == 0xF5 ? 0 : bits[op - 0xF8];
+        RegVal set = clear * (op & 1);
+        ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+            f[i] = Select(mi, RegVal(((f[i] ^ flip) & ~clear) | set), f[i]);
+        });
+        length = 1;
+    } else {
+        return false;
+    }
+    ForLanes(count, m, [&](std::size_t i, uint8_t mi) {
+        ip[i] = RegVal(ip[i] + mi * length);
+    });
+    return true;
+}
+
+void Lockstep::StepScalar(std::size_t lane)
+{
+    auto& l = *lanes[lane];
+    auto& state = l.cpu.State();
+    StoreState(lane, state);
+    l.halted = l.cpu.Run(1);
+    ++l.steps;
+    for (int i = 0; i < 8; ++i) {
+        gpr[i][lane] = state.gpr[i];
+    }
+    for (int i = 0; i < 6; ++i) {
+        sregs[i][lane] = state.sregs[i];
+    }
+    ip[lane] = state.ip;
+    flags[lane] = state.flags;
+}
+
+bool Lockstep::FetchCode(std::size_t lane, uint8_t* code)
+{
+    auto hook = lanes[lane]->hook;
+    auto& state = lanes[lane]->cpu.State();
+    uint32_t base = sregs[CS][lane] * 0x10;
+    RegVal offset = ip[lane];
+    auto span = hook->Direct(base + offset, false);
+    if (span.size >= MaxCode && RegVal(offset + MaxCode) > offset) {
+        std::memcpy(code, span.data, MaxCode);
+        return CodeLength(code[0]) != 0;
+    }
+    auto read = [&](int first, int size) {
+        RegVal at = RegVal(offset + first);
+        if (RegVal(at + size) > at) {
+            hook->ReadMem(state, code + first, size, base + at);
+            return;
+        }
+        for (int i = 0; i < size; ++i) {
+            hook->ReadMem(state, code + first + i, 1, base + RegVal(at + i));
+        }
+    };
+    read(0, 1);
+    auto length = CodeLength(code[0]);
+    if (length > 1) {
+        read(1, length - 1);
+    }
+    return length != 0;
+}
+
+} // namespace x86emu
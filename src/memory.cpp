@@ -0,0 +1,407 @@
+#include "include/cpu86e/memory.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace cpu86e {
+
+namespace {
+
+const uint8_t zeroPage[Memory::PageSize] = {};
+
+auto PageAlign(size_t size) -> size_t
+{
+    return (size + Memory::PageSize - 1) & ~size_t(Memory::PageSize - 1);
+}
+
+}
+
+MappedFile::MappedFile() :
+    data(nullptr),
+    size(0),
+    fileSize(0)
+{}
+
+#ifdef _WIN32
+MappedFile::MappedFile(const char *path, bool writable) :
+    MappedFile()
+{
+    auto file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Can't open image");
+    }
+    LARGE_INTEGER length;
+    GetFileSizeEx(file, &length);
+    fileSize = size_t(length.QuadPart);
+    if (fileSize == 0) {
+        CloseHandle(file);
+        return;
+    }
+    auto mapping = CreateFileMappingW(file, nullptr, writable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) {
+        throw std::runtime_error("Can't map image");
+    }
+    auto view = MapViewOfFile(mapping, writable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) {
+        throw std::runtime_error("Can't map image");
+    }
+    data = static_cast<uint8_t*>(view);
+    size = PageAlign(fileSize);
+}
+
+void MappedFile::Close()
+{
+    if (data) {
+        UnmapViewOfFile(data);
+    }
+}
+#else
+MappedFile::MappedFile(const char *path, bool writable) :
+    MappedFile()
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        throw std::runtime_error("Can't open image");
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        throw std::runtime_error("Can't open image");
+    }
+    fileSize = size_t(st.st_size);
+    if (fileSize == 0) {
+        close(fd);
+        return;
+    }
+    auto prot = PROT_READ | (writable ? PROT_WRITE : 0);
+    auto view = mmap(nullptr, PageAlign(fileSize), prot, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) {
+        throw std::runtime_error("Can't map image");
+    }
+    data = static_cast<uint8_t*>(view);
+    size = PageAlign(fileSize);
+}
+
+void MappedFile::Close()
+{
+    if (data) {
+        munmap(data, size);
+    }
+}
+#endif
+
+MappedFile::MappedFile(MappedFile &&other) :
+    data(std::exchange(other.data, nullptr)),
+    size(std::exchange(other.size, 0)),
+    fileSize(std::exchange(other.fileSize, 0))
+{}
+
+MappedFile& MappedFile::operator=(MappedFile &&other)
+{
+    if (this != &other) {
+        Close();
+        data = std::exchange(other.data, nullptr);
+        size = std::exchange(other.size, 0);
+        fileSize = std::exchange(other.fileSize, 0);
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+auto MappedFile::Data() const -> uint8_t*
+{
+    return data;
+}
+
+auto MappedFile::Size() const -> size_t
+{
+    return size;
+}
+
+auto MappedFile::FileSize() const -> size_t
+{
+    return fileSize;
+}
+
+Image::Image(std::vector<uint8_t> data, size_t size) :
+    storage(std::move(data)),
+    data(storage.data()),
+    size(size)
+{}
+
+Image::Image(MappedFile file) :
+    file(std::move(file)),
+    data(this->file.Data()),
+    size(this->file.FileSize())
+{}
+
+auto Image::FromFile(const char* path) -> std::shared_ptr<const Image>
+{
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (file.fail()) {
+        throw std::runtime_error("Can't open image");
+    }
+    size_t size = file.tellg();
+    file.seekg(0);
+    std::vector<uint8_t> data(PageAlign(size));
+    file.read(reinterpret_cast<char*>(data.data()), size);
+    return std::shared_ptr<const Image>(new Image(std::move(data), size));
+}
+
+auto Image::FromBuffer(std::vector<uint8_t> data) -> std::shared_ptr<const Image>
+{
+    auto size = data.size();
+    data.resize(PageAlign(size));
+    return std::shared_ptr<const Image>(new Image(std::move(data), size));
+}
+
+auto Image::Map(const char *path) -> std::shared_ptr<const Image>
+{
+    return std::shared_ptr<const Image>(new Image(MappedFile(path, false)));
+}
+
+auto Image::Data() const -> const uint8_t*
+{
+    return data;
+}
+
+auto Image::Size() const -> size_t
+{
+    return size;
+}
+
+Memory::Memory()
+{
+    for (auto& page : pages) {
+        page = { nullptr, nullptr, Unmapped };
+    }
+}
+
+void Memory::MapRam(uint32_t addr, uint32_t size)
+{
+    for (auto i = addr >> PageBits; i < (addr + size) >> PageBits; ++i) {
+        SetPage(i, Cow, zeroPage, nullptr);
+    }
+}
+
+void Memory::MapRam(uint32_t addr, uint8_t *host, uint32_t size)
+{
+    for (auto i = addr >> PageBits; i < (addr + size) >> PageBits; ++i) {
+        SetPage(i, Ram, host, host);
+        host += PageSize;
+    }
+}
+
+void Memory::MapRom(uint32_t addr, const uint8_t *host, uint32_t size)
+{
+    for (auto i = addr >> PageBits; i < (addr + size) >> PageBits; ++i) {
+        SetPage(i, Rom, host, nullptr);
+        host += PageSize;
+    }
+}
+
+void Memory::MapImage(uint32_t addr, std::shared_ptr<const Image> image, size_t offset, uint32_t size, bool writable)
+{
+    auto kind = writable ? Cow : Rom;
+    auto imageSize = PageAlign(image->Size());
+    for (auto i = addr >> PageBits; i < (addr + size) >> PageBits; ++i) {
+        auto data = offset < imageSize ? image->Data() + offset : zeroPage;
+        SetPage(i, kind, data, nullptr);
+        offset += PageSize;
+    }
+    if (std::find(images.begin(), images.end(), image) == images.end()) {
+        images.push_back(std::move(image));
+    }
+}
+
+void Memory::MapFile(uint32_t addr, const char *path, uint32_t size, bool writable)
+{
+    MappedFile file(path, writable);
+    auto mapped = std::min<size_t>(file.Size(), size);
+    if (writable) {
+        MapRam(addr, file.Data(), mapped);
+        MapRam(addr + mapped, size - mapped);
+    } else {
+        MapRom(addr, file.Data(), mapped);
+        Unmap(addr + mapped, size - mapped);
+    }
+    files.push_back(std::move(file));
+}
+
+void Memory::Unmap(uint32_t addr, uint32_t size)
+{
+    for (auto i = addr >> PageBits; i < (addr + size) >> PageBits; ++i) {
+        SetPage(i, Unmapped, nullptr, nullptr);
+    }
+}
+
+void Memory::Read(void *data, size_t size, uint32_t addr) const
+{
+    auto out = static_cast<uint8_t*>(data);
+    while (size != 0) {
+        addr &= AddressSize - 1;
+        auto& page = pages[addr >> PageBits];
+        auto offset = addr & (PageSize - 1);
+        auto n = std::min<size_t>(size, PageSize - offset);
+        if (page.read) {
+            std::memcpy(out, page.read + offset, n);
+        } else {
+            std::memset(out, 0xFF, n);
+        }
+        out += n;
+        addr += n;
+        size -= n;
+    }
+}
+
+void Memory::Write(uint32_t addr, const void *data, size_t size)
+{
+    auto in = static_cast<const uint8_t*>(data);
+    while (size != 0) {
+        addr &= AddressSize - 1;
+        auto index = addr >> PageBits;
+        auto offset = addr & (PageSize - 1);
+        auto n = std::min<size_t>(size, PageSize - offset);
+        auto dst = pages[index].write;
+        if (!dst && pages[index].kind == Cow) {
+            dst = CopyOnWrite(index);
+        }
+        if (dst) {
+            std::memcpy(dst + offset, in, n);
+            dirty.set(index);
+        }
+        in += n;
+        addr += n;
+        size -= n;
+    }
+}
+
+auto Memory::Direct(uint32_t addr, bool write) -> HostSpan
+{
+    addr &= AddressSize - 1;
+    auto index = addr >> PageBits;
+    auto offset = addr & (PageSize - 1);
+    auto& page = pages[index];
+    if (!write) {
+        if (!page.read) {
+            return {};
+        }
+        return { const_cast<uint8_t*>(page.read) + offset, PageSize - offset };
+    }
+    auto dst = page.write;
+    if (!dst && page.kind == Cow) {
+        dst = CopyOnWrite(index);
+    }
+    if (!dst) {
+        return {};
+    }
+    dirty.set(index);
+    return { dst + offset, PageSize - offset };
+}
+
+auto Memory::PrivatePages() const -> size_t
+{
+    return std::count_if(std::begin(owned), std::end(owned), [](auto& page){
+        return page != nullptr;
+    });
+}
+
+void Memory::Save(Snapshot &snapshot)
+{
+    snapshot.data.clear();
+    for (uint32_t i = 0; i < PageCount; ++i) {
+        auto& page = pages[i];
+        snapshot.pages[i] = page;
+        snapshot.owned[i] = owned[i] && page.write == owned[i].get();
+        if (!page.write) {
+            snapshot.offsets[i] = Snapshot::NoData;
+            continue;
+        }
+        snapshot.offsets[i] = uint32_t(snapshot.data.size());
+        snapshot.data.insert(snapshot.data.end(), page.write, page.write + PageSize);
+    }
+    dirty.reset();
+}
+
+void Memory::Restore(const Snapshot &snapshot)
+{
+    for (uint32_t i = 0; i < PageCount; ++i) {
+        auto& saved = snapshot.pages[i];
+        if (!dirty[i] && pages[i] == saved) {
+            continue;
+        }
+        if (snapshot.offsets[i] == Snapshot::NoData) {
+            pages[i] = saved;
+            owned[i].reset();
+            continue;
+        }
+        auto& page = pages[i];
+        auto dst = page.write;
+        auto own = owned[i] && page.write == owned[i].get();
+        if (snapshot.owned[i] || !dst || own) {
+            if (!owned[i]) {
+                owned[i].reset(new uint8_t[PageSize]);
+            }
+            dst = owned[i].get();
+        }
+        page = { dst, dst, saved.kind };
+        std::memcpy(dst, snapshot.data.data() + snapshot.offsets[i], PageSize);
+    }
+    dirty.reset();
+}
+
+void Memory::MarkDirty(uint32_t addr, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    for (auto i = addr >> PageBits; i <= (addr + size - 1) >> PageBits; ++i) {
+        dirty.set(i & (PageCount - 1));
+    }
+}
+
+auto Memory::Dirty() const -> const PageSet&
+{
+    return dirty;
+}
+
+void Memory::ClearDirty()
+{
+    dirty.reset();
+}
+
+void Memory::SetPage(uint32_t index, Kind kind, const uint8_t *read, uint8_t *write)
+{
+    pages[index] = { read, write, kind };
+    owned[index].reset();
+}
+
+auto Memory::CopyOnWrite(uint32_t index) -> uint8_t*
+{
+    auto& page = pages[index];
+    owned[index].reset(new uint8_t[PageSize]);
+    auto data = owned[index].get();
+    std::memcpy(data, page.read, PageSize);
+    page = { data, data, Ram };
+    return data;
+}
+
+} // namespace x86emu
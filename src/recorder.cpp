@@ -0,0 +1,430 @@
+#include "include/cpu86e/recorder.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+namespace cpu86e {
+
+namespace {
+
+const char recordingMagic[4] = { 'C', '8', '6', 'R' };
+
+void PutVarint(std::vector<uint8_t>& out, uint64_t val)
+{
+    while (val >= 0x80) {
+        out.push_back(uint8_t(val) | 0x80);
+        val >>= 7;
+    }
+    out.push_back(uint8_t(val));
+}
+
+auto GetVarint(const std::vector<uint8_t>& in, size_t& pos) -> uint64_t
+{
+    uint64_t val = 0;
+    for (int shift = 0; pos < in.size(); shift += 7) {
+        auto byte = in[pos++];
+        val |= uint64_t(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return val;
+        }
+    }
+    throw std::runtime_error("Truncated recording");
+}
+
+}
+
+void Recording::Save(const char *path) const
+{
+    std::ofstream file(path, std::ios::binary);
+    uint64_t size = events.size();
+    file.write(recordingMagic, sizeof(recordingMagic));
+    file.write(reinterpret_cast<const char*>(&initial), sizeof(initial));
+    file.write(reinterpret_cast<const char*>(&start), sizeof(start));
+    file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+    file.write(reinterpret_cast<const char*>(events.data()), size);
+    if (file.fail()) {
+        throw std::runtime_error("Can't write recording");
+    }
+}
+
+auto Recording::Load(const char *path) -> Recording
+{
+    std::ifstream file(path, std::ios::binary);
+    Recording result;
+    char magic[sizeof(recordingMagic)];
+    uint64_t size = 0;
+    file.read(magic, sizeof(magic));
+    file.read(reinterpret_cast<char*>(&result.initial), sizeof(result.initial));
+    file.read(reinterpret_cast<char*>(&result.start), sizeof(result.start));
+    file.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (file.fail() || std::memcmp(magic, recordingMagic, sizeof(magic)) != 0) {
+        throw std::runtime_error("Can't read recording");
+    }
+    auto here = file.tellg();
+    file.seekg(0, std::ios::end);
+    auto end = file.tellg();
+    file.seekg(here);
+    if (here < 0 || end < here || size > uint64_t(end - here)) {
+        throw std::runtime_error("Can't read recording");
+    }
+    result.events.resize(size);
+    file.read(reinterpret_cast<char*>(result.events.data()), size);
+    if (file.fail()) {
+        throw std::runtime_error("Can't read recording");
+    }
+    return result;
+}
+
+void MmioRanges::AddMmio(uint32_t addr, uint32_t size)
+{
+    ranges.emplace_back(addr, size);
+}
+
+bool MmioRanges::IsMmio(uint32_t addr, size_t size) const
+{
+    for (auto& [start, length] : ranges) {
+        if (addr < start + length && start < addr + size) {
+            return true;
+        }
+    }
+    return false;
+}
+
+auto MmioRanges::Clip(uint32_t addr, size_t size) const -> size_t
+{
+    for (auto& [start, length] : ranges) {
+        if (addr >= start && addr - start < length) {
+            return 0;
+        }
+        if (start > addr) {
+            size = std::min<size_t>(size, start - addr);
+        }
+    }
+    return size;
+}
+
+Recorder::Recorder(IIOHook &inner) :
+    inner(&inner),
+    cpu(nullptr),
+    recording{},
+    last(0)
+{}
+
+void Recorder::Start(CPU &argCpu)
+{
+    argCpu.LoadState(argCpu.State());
+    cpu = &argCpu;
+    recording.initial = cpu->State();
+    recording.start = last = cpu->Instructions();
+    recording.events.clear();
+}
+
+auto Recorder::Finish() -> Recording
+{
+    Put(Recording::End);
+    cpu = nullptr;
+    return std::move(recording);
+}
+
+void Recorder::ReadMem(CPUState &state, void *data, size_t size, uint32_t addr)
+{
+    inner->ReadMem(state, data, size, addr);
+    if (cpu && IsMmio(addr, size)) {
+        Put(Recording::Mmio);
+        auto bytes = static_cast<const uint8_t*>(data);
+        PutVarint(recording.events, size);
+        recording.events.insert(recording.events.end(), bytes, bytes + size);
+    }
+}
+
+void Recorder::WriteMem(CPUState &state, uint32_t addr, void *data, size_t size)
+{
+    inner->WriteMem(state, addr, data, size);
+}
+
+auto Recorder::ReadIOByte(uint32_t addr) -> uint8_t
+{
+    auto val = inner->ReadIOByte(addr);
+    if (cpu) {
+        Put(Recording::IOByte);
+        recording.events.push_back(val);
+    }
+    return val;
+}
+
+auto Recorder::ReadIOWord(uint32_t addr) -> uint16_t
+{
+    auto val = inner->ReadIOWord(addr);
+    if (cpu) {
+        Put(Recording::IOWord);
+        recording.events.push_back(uint8_t(val));
+        recording.events.push_back(uint8_t(val >> 8));
+    }
+    return val;
+}
+
+void Recorder::WriteIOByte(uint32_t addr, uint8_t val)
+{
+    inner->WriteIOByte(addr, val);
+}
+
+void Recorder::WriteIOWord(uint32_t addr, uint16_t val)
+{
+    inner->WriteIOWord(addr, val);
+}
+
+void Recorder::AcceptInterrupt(int interrupt)
+{
+    inner->AcceptInterrupt(interrupt);
+    if (!cpu) {
+        return;
+    }
+    if (interrupt == CPU::NonMaskable) {
+        Put(Recording::NMI);
+    } else {
+        Put(Recording::Interrupt);
+        recording.events.push_back(uint8_t(interrupt));
+    }
+}
+
+auto Recorder::Direct(uint32_t addr, bool write) -> HostSpan
+{
+    auto span = inner->Direct(addr, write);
+    span.size = Clip(addr, span.size);
+    return span.size ? span : HostSpan{};
+}
+
+void Recorder::HostWrite(uint32_t addr, const void *data, size_t size)
+{
+    inner->HostWrite(addr, data, size);
+    if (cpu) {
+        Put(Recording::Write);
+        PutVarint(recording.events, addr);
+        PutVarint(recording.events, size);
+        auto bytes = static_cast<const uint8_t*>(data);
+        recording.events.insert(recording.events.end(), bytes, bytes + size);
+    }
+}
+
+void Recorder::Put(Recording::Event event)
+{
+    auto now = cpu->Instructions();
+    PutVarint(recording.events, now - last);
+    recording.events.push_back(event);
+    last = now;
+}
+
+Replayer::Replayer(IIOHook &memory, Recording recording) :
+    Replayer(memory, std::make_shared<const Recording>(std::move(recording)))
+{}
+
+Replayer::Replayer(IIOHook &memory, std::shared_ptr<const Recording> recording) :
+    memory(&memory),
+    cpu(nullptr),
+    recording(std::move(recording)),
+    pos(0),
+    origin(NotStarted),
+    when(0),
+    event(Recording::End),
+    finished(false)
+{
+    Next();
+}
+
+auto Replayer::Initial() const -> const CPUState&
+{
+    return recording->initial;
+}
+
+auto Replayer::Run(CPU &cpu, long long steps) -> int
+{
+    this->cpu = &cpu;
+    if (origin == NotStarted) {
+        origin = cpu.Instructions();
+    }
+    while (true) {
+        auto now = cpu.Instructions() - origin;
+        if (event == Recording::Write && now >= when) {
+            ApplyWrite(cpu);
+            continue;
+        }
+        if (now > when) {
+            throw std::runtime_error("Replay diverged");
+        }
+        if (event == Recording::End && now == when) {
+            finished = true;
+            return 1;
+        }
+        if (steps == 0) {
+            return 0;
+        }
+        if ((event == Recording::Interrupt || event == Recording::NMI) && now == when) {
+            auto scan = pos;
+            auto at = when;
+            auto kind = event;
+            while (at == when && (kind == Recording::Interrupt || kind == Recording::NMI)) {
+                if (kind == Recording::NMI) {
+                    cpu.SetNMI(1);
+                } else {
+                    cpu.SetINTR(recording->events.at(scan++));
+                }
+                if (scan >= recording->events.size()) {
+                    break;
+                }
+                at += GetVarint(recording->events, scan);
+                kind = Recording::Event(recording->events.at(scan++));
+            }
+            cpu.Run(1);
+            cpu.SetNMI(0);
+            cpu.SetINTR(CPU::NoInterrupt);
+        } else {
+            auto chunk = when - now + (event <= Recording::Mmio);
+            if (steps != -1 && uint64_t(steps) < chunk) {
+                chunk = steps;
+            }
+            while (cpu.Instructions() - origin - now < chunk) {
+                auto before = cpu.Instructions();
+                auto halted = cpu.Run(int(std::min<uint64_t>(chunk - (before - origin - now), 1 << 30)));
+                if (halted && cpu.Instructions() == before) {
+                    throw std::runtime_error("Replay diverged");
+                }
+            }
+        }
+        if (steps != -1) {
+            steps -= std::min<long long>(steps, cpu.Instructions() - origin - now);
+        }
+    }
+}
+
+bool Replayer::Pending(const CPU &cpu) const
+{
+    auto interrupt = event == Recording::Interrupt || event == Recording::NMI;
+    return interrupt && when == Tell(cpu).instructions;
+}
+
+auto Replayer::Tell(const CPU &cpu) const -> Position
+{
+    auto instructions = origin == NotStarted ? 0 : cpu.Instructions() - origin;
+    return { instructions, pos, when, event };
+}
+
+void Replayer::Seek(const CPU &cpu, const Position &position)
+{
+    this->cpu = &cpu;
+    origin = cpu.Instructions() - position.instructions;
+    pos = position.pos;
+    when = position.when;
+    event = position.event;
+    finished = false;
+}
+
+bool Replayer::Finished() const
+{
+    return finished;
+}
+
+void Replayer::ReadMem(CPUState &state, void *data, size_t size, uint32_t addr)
+{
+    if (!IsMmio(addr, size)) {
+        memory->ReadMem(state, data, size, addr);
+        return;
+    }
+    auto payload = Take(Recording::Mmio);
+    auto begin = size_t(payload - recording->events.data());
+    auto length = GetVarint(recording->events, begin);
+    if (length != size || begin + length > recording->events.size()) {
+        throw std::runtime_error("Replay diverged");
+    }
+    std::memcpy(data, recording->events.data() + begin, size);
+    pos = begin + length;
+    Next();
+}
+
+void Replayer::WriteMem(CPUState &state, uint32_t addr, void *data, size_t size)
+{
+    if (!IsMmio(addr, size)) {
+        memory->WriteMem(state, addr, data, size);
+    }
+}
+
+auto Replayer::ReadIOByte(uint32_t addr) -> uint8_t
+{
+    auto val = Take(Recording::IOByte)[0];
+    ++pos;
+    Next();
+    return val;
+}
+
+auto Replayer::ReadIOWord(uint32_t addr) -> uint16_t
+{
+    auto payload = Take(Recording::IOWord);
+    uint16_t val = payload[0] | payload[1] << 8;
+    pos += 2;
+    Next();
+    return val;
+}
+
+void Replayer::WriteIOByte(uint32_t addr, uint8_t val)
+{}
+
+void Replayer::WriteIOWord(uint32_t addr, uint16_t val)
+{}
+
+void Replayer::AcceptInterrupt(int interrupt)
+{
+    if (interrupt == CPU::NonMaskable) {
+        Take(Recording::NMI);
+    } else if (Take(Recording::Interrupt)[0] == uint8_t(interrupt)) {
+        ++pos;
+    } else {
+        throw std::runtime_error("Replay diverged");
+    }
+    Next();
+}
+
+auto Replayer::Direct(uint32_t addr, bool write) -> HostSpan
+{
+    auto span = memory->Direct(addr, write);
+    span.size = Clip(addr, span.size);
+    return span.size ? span : HostSpan{};
+}
+
+void Replayer::HostWrite(uint32_t addr, const void *data, size_t size)
+{}
+
+void Replayer::Next()
+{
+    if (pos >= recording->events.size()) {
+        event = Recording::End;
+        return;
+    }
+    when += GetVarint(recording->events, pos);
+    event = Recording::Event(recording->events.at(pos++));
+}
+
+void Replayer::ApplyWrite(CPU &cpu)
+{
+    auto& events = recording->events;
+    auto addr = GetVarint(events, pos);
+    auto size = GetVarint(events, pos);
+    if (size > events.size() - pos) {
+        throw std::runtime_error("Truncated recording");
+    }
+    cpu.Write(uint32_t(addr), events.data() + pos, size_t(size));
+    pos += size_t(size);
+    Next();
+}
+
+auto Replayer::Take(Recording::Event expected) -> const uint8_t*
+{
+    if (event != expected || pos > recording->events.size()) {
+        throw std::runtime_error("Replay diverged");
+    }
+    if (cpu && origin != NotStarted && cpu->Instructions() - origin != when) {
+        throw std::runtime_error("Replay diverged");
+    }
+    return recording->events.data() + pos;
+}
+
+} // namespace x86emu
@@ -0,0 +1,369 @@
+#include "include/cpu86e/rewinder.h"
+#include <algorithm>
+
+namespace cpu86e {
+
+namespace {
+
+constexpr RegVal TrapFlag = 0x100;
+constexpr uint64_t NotFound = ~uint64_t(0);
+
+}
+
+class Rewinder::WriteWatch : public IIOHook
+{
+public:
+    WriteWatch(IIOHook& inner, uint32_t addr, size_t size) :
+        inner(&inner),
+        addr(addr),
+        size(size),
+        hit(false)
+    {}
+
+    void ReadMem(CPUState& state, void* data, size_t size, uint32_t addr) override
+    {
+        inner->ReadMem(state, data, size, addr);
+    }
+
+    void WriteMem(CPUState& state, uint32_t addr, void* data, size_t size) override
+    {
+        auto mask = Memory::AddressSize - 1;
+        if (((addr - this->addr) & mask) < this->size || ((this->addr - addr) & mask) < size) {
+            hit = true;
+        }
+        inner->WriteMem(state, addr, data, size);
+    }
+
+    auto ReadIOByte(uint32_t addr) -> uint8_t override
+    {
+        return inner->ReadIOByte(addr);
+    }
+
+    auto ReadIOWord(uint32_t addr) -> uint16_t override
+    {
+        return inner->ReadIOWord(addr);
+    }
+
+    void WriteIOByte(uint32_t addr, uint8_t val) override
+    {
+        inner->WriteIOByte(addr, val);
+    }
+
+    void WriteIOWord(uint32_t addr, uint16_t val) override
+    {
+        inner->WriteIOWord(addr, val);
+    }
+
+    void AcceptInterrupt(int interrupt) override
+    {
+        inner->AcceptInterrupt(interrupt);
+    }
+
+    void HostWrite(uint32_t addr, const void* data, size_t size) override
+    {
+        inner->HostWrite(addr, data, size);
+    }
+
+    auto Direct(uint32_t addr, bool write) -> HostSpan override
+    {
+        auto span = inner->Direct(addr, write);
+        if (!write) {
+            return span;
+        }
+        auto mask = Memory::AddressSize - 1;
+        if (((addr - this->addr) & mask) < this->size) {
+            return {};
+        }
+        span.size = std::min<size_t>(span.size, (this->addr - addr) & mask);
+        return span;
+    }
+
+    IIOHook* inner;
+    uint32_t addr;
+    size_t size;
+    bool hit;
+};
+
+Rewinder::Rewinder(CPU &cpu, Memory &memory, Replayer *replayer) :
+    cpu(&cpu),
+    memory(&memory),
+    replayer(replayer),
+    current(0),
+    capacity(64),
+    overhead(0.02),
+    interval(65536),
+    origin(0),
+    running(0)
+{}
+
+void Rewinder::SetCapacity(std::size_t frames)
+{
+    capacity = std::max<std::size_t>(frames, 1);
+    while (this->frames.size() > capacity) {
+        Fold();
+    }
+}
+
+void Rewinder::SetOverhead(double fraction)
+{
+    overhead = fraction;
+}
+
+void Rewinder::Start()
+{
+    frames.clear();
+    origin = cpu->Instructions();
+    running = {};
+    Capture(true);
+}
+
+auto Rewinder::Run(long long steps) -> int
+{
+    using Clock = std::chrono::steady_clock;
+    if (frames.empty()) {
+        Start();
+    }
+    while (steps != 0) {
+        auto now = Now();
+        auto due = frames.back().instructions + interval;
+        uint64_t chunk = due > now ? due - now : 1;
+        if (steps != -1) {
+            chunk = std::min<uint64_t>(chunk, steps);
+        }
+        auto start = Clock::now();
+        auto halted = Advance(chunk);
+        running += Clock::now() - start;
+        if (steps != -1) {
+            steps -= std::min<long long>(steps, Now() - now);
+        }
+        if (halted) {
+            return 1;
+        }
+        if (Now() >= due && Safe()) {
+            start = Clock::now();
+            Capture(false);
+            auto cost = Clock::now() - start;
+            if (cost > running * overhead) {
+                interval *= 2;
+            } else if (cost * 4 < running * overhead && interval > MinInterval) {
+                interval /= 2;
+            }
+            running = {};
+        }
+    }
+    return 0;
+}
+
+auto Rewinder::Now() const -> uint64_t
+{
+    return cpu->Instructions() - origin;
+}
+
+auto Rewinder::Oldest() const -> uint64_t
+{
+    return frames.empty() ? Now() : frames.front().instructions;
+}
+
+auto Rewinder::Interval() const -> uint64_t
+{
+    return interval;
+}
+
+bool Rewinder::Seek(uint64_t instructions)
+{
+    if (frames.empty() || instructions < frames.front().instructions) {
+        return false;
+    }
+    auto now = Now();
+    if (instructions >= now) {
+        Advance(instructions - now);
+        return true;
+    }
+    auto frame = frames.size() - 1;
+    while (frames[frame].instructions > instructions) {
+        --frame;
+    }
+    Restore(frame);
+    Truncate();
+    Advance(instructions - frames[frame].instructions);
+    return true;
+}
+
+bool Rewinder::StepBack(uint64_t steps)
+{
+    auto now = Now();
+    return steps <= now && Seek(now - steps);
+}
+
+bool Rewinder::RunBackToWrite(uint32_t addr, size_t size)
+{
+    if (frames.empty()) {
+        return false;
+    }
+    Snapshot(false);
+    auto present = current;
+    for (auto frame = present; frame-- > 0;) {
+        auto end = frames[frame + 1].instructions;
+        auto& touched = frames[frame + 1].pages;
+        auto hit = false;
+        for (size_t offset = 0; offset < size; offset += Memory::PageSize) {
+            hit |= touched[((addr + offset) & (Memory::AddressSize - 1)) >> Memory::PageBits];
+        }
+        hit |= touched[((addr + size - 1) & (Memory::AddressSize - 1)) >> Memory::PageBits];
+        if (!hit) {
+            continue;
+        }
+        Restore(frame);
+        auto inner = cpu->Hook();
+        WriteWatch watch(*inner, addr, size);
+        auto found = NotFound;
+        cpu->SetHook(&watch);
+        try {
+            while (Now() < end) {
+                auto before = Now();
+                watch.hit = false;
+                Advance(1);
+                if (Now() == before) {
+                    break;
+                }
+                if (watch.hit) {
+                    found = before;
+                }
+            }
+        } catch (...) {
+            cpu->SetHook(inner);
+            Restore(present);
+            Discard();
+            throw;
+        }
+        cpu->SetHook(inner);
+        if (found != NotFound) {
+            Seek(found);
+            return true;
+        }
+    }
+    Restore(present);
+    Discard();
+    return false;
+}
+
+auto Rewinder::Advance(uint64_t steps) -> int
+{
+    if (replayer) {
+        return replayer->Run(*cpu, (long long)steps);
+    }
+    while (steps != 0) {
+        auto before = cpu->Instructions();
+        if (cpu->Run(int(std::min<uint64_t>(steps, 1 << 30)))) {
+            return 1;
+        }
+        steps -= std::min<uint64_t>(steps, cpu->Instructions() - before);
+    }
+    return 0;
+}
+
+bool Rewinder::Safe() const
+{
+    return !(cpu->State().flags & TrapFlag) && !(replayer && replayer->Pending(*cpu));
+}
+
+void Rewinder::Snapshot(bool all)
+{
+    auto& frame = frames.emplace_back();
+    frame.instructions = Now();
+    frame.state = cpu->State();
+    frame.position = replayer ? replayer->Tell(*cpu) : Replayer::Position{};
+    frame.pages = memory->Dirty();
+    if (all) {
+        frame.pages.set();
+    }
+    frame.data.resize(frame.pages.count() * Memory::PageSize);
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < Memory::PageCount; ++i) {
+        frame.offsets[i] = Frame::NoData;
+        if (frame.pages[i]) {
+            frame.offsets[i] = offset;
+            memory->Read(frame.data.data() + offset, Memory::PageSize, i << Memory::PageBits);
+            offset += Memory::PageSize;
+        }
+    }
+    memory->ClearDirty();
+    current = frames.size() - 1;
+}
+
+void Rewinder::Capture(bool all)
+{
+    Snapshot(all);
+    if (frames.size() > capacity) {
+        Fold();
+    }
+}
+
+void Rewinder::Fold()
+{
+    auto& base = frames[0];
+    auto& next = frames[1];
+    for (uint32_t i = 0; i < Memory::PageCount; ++i) {
+        if (next.pages[i]) {
+            std::copy_n(next.data.data() + next.offsets[i], Memory::PageSize, base.data.data() + base.offsets[i]);
+        }
+    }
+    base.instructions = next.instructions;
+    base.state = next.state;
+    base.position = next.position;
+    frames.erase(frames.begin() + 1);
+    --current;
+}
+
+void Rewinder::Restore(std::size_t frame)
+{
+    auto changed = Changed(frame);
+    for (uint32_t i = 0; i < Memory::PageCount; ++i) {
+        if (!changed[i]) {
+            continue;
+        }
+        auto source = frame;
+        while (!frames[source].pages[i]) {
+            --source;
+        }
+        auto& from = frames[source];
+        memory->Write(i << Memory::PageBits, from.data.data() + from.offsets[i], Memory::PageSize);
+    }
+    memory->ClearDirty();
+    current = frame;
+    auto& target = frames[frame];
+    cpu->LoadState(target.state);
+    cpu->SetHalt(0);
+    origin = cpu->Instructions() - target.instructions;
+    if (replayer) {
+        replayer->Seek(*cpu, target.position);
+    }
+}
+
+void Rewinder::Discard()
+{
+    auto& frame = frames.back();
+    for (uint32_t i = 0; i < Memory::PageCount; ++i) {
+        if (frame.pages[i]) {
+            memory->MarkDirty(i << Memory::PageBits, Memory::PageSize);
+        }
+    }
+    frames.pop_back();
+    current = frames.size() - 1;
+}
+
+void Rewinder::Truncate()
+{
+    frames.erase(frames.begin() + current + 1, frames.end());
+}
+
+auto Rewinder::Changed(std::size_t frame) const -> Memory::PageSet
+{
+    auto changed = memory->Dirty();
+    for (auto i = std::min(frame, current) + 1; i <= std::max(frame, current); ++i) {
+        changed |= frames[i].pages;
+    }
+    return changed;
+}
+
+} // namespace x86emu
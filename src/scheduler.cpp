@@ -0,0 +1,105 @@
+#include "include/cpu86e/scheduler.h"
+#include <algorithm>
+
+namespace cpu86e {
+
+Scheduler::Scheduler() :
+    nextId(0),
+    idle(0),
+    dispatched(0)
+{}
+
+auto Scheduler::Now(const CPU &cpu) const -> uint64_t
+{
+    return cpu.Instructions() + idle;
+}
+
+auto Scheduler::Schedule(uint64_t when, Callback callback) -> uint64_t
+{
+    auto id = nextId++;
+    callbacks.emplace(id, std::move(callback));
+    queue.push_back({ when, id });
+    std::push_heap(queue.begin(), queue.end(), Later);
+    return id;
+}
+
+void Scheduler::Cancel(uint64_t id)
+{
+    callbacks.erase(id);
+    Prune();
+}
+
+auto Scheduler::Next() const -> uint64_t
+{
+    return queue.empty() ? Never : queue.front().when;
+}
+
+auto Scheduler::StableUntil(uint64_t since) const -> uint64_t
+{
+    if (dispatched > since) {
+        return since;
+    }
+    auto next = Next();
+    if (next == Never) {
+        return Never;
+    }
+    return next > idle ? next - idle : 0;
+}
+
+int Scheduler::Run(CPU &cpu, uint64_t until, int slice)
+{
+    while (true) {
+        Dispatch(cpu);
+        auto now = Now(cpu);
+        if (now >= until) {
+            return 0;
+        }
+        auto target = std::min(Next(), until);
+        auto steps = std::min<uint64_t>(target - now, slice);
+        if (!cpu.Run(int(steps))) {
+            continue;
+        }
+        if (queue.empty()) {
+            return 1;
+        }
+        now = Now(cpu);
+        target = std::min(Next(), until);
+        if (target > now) {
+            idle += target - now;
+        }
+    }
+}
+
+bool Scheduler::Later(const Event &a, const Event &b)
+{
+    return a.when != b.when ? a.when > b.when : a.id > b.id;
+}
+
+void Scheduler::Dispatch(const CPU &cpu)
+{
+    auto now = Now(cpu);
+    while (!queue.empty() && queue.front().when <= now) {
+        std::pop_heap(queue.begin(), queue.end(), Later);
+        auto id = queue.back().id;
+        queue.pop_back();
+        auto it = callbacks.find(id);
+        if (it == callbacks.end()) {
+            continue;
+        }
+        auto callback = std::move(it->second);
+        callbacks.erase(it);
+        dispatched = cpu.Instructions();
+        callback(now);
+    }
+    Prune();
+}
+
+void Scheduler::Prune()
+{
+    while (!queue.empty() && !callbacks.contains(queue.front().id)) {
+        std::pop_heap(queue.begin(), queue.end(), Later);
+        queue.pop_back();
+    }
+}
+
+} // namespace x86emu
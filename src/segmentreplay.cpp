@@ -0,0 +1,187 @@
+#include "include/cpu86e/segmentreplay.h"
+#include <algorithm>
+#include <exception>
+#include <mutex>
+
+namespace cpu86e {
+
+namespace {
+
+constexpr RegVal TrapFlag = 0x100;
+
+void HashBytes(uint64_t& hash, const void* data, size_t size)
+{
+    auto bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3;
+    }
+}
+
+}
+
+struct SegmentReplay::Hook : IIOHook {
+    Memory* memory;
+
+    explicit Hook(Memory& memory) :
+        memory(&memory)
+    {}
+
+    void ReadMem(CPUState& state, void* data, size_t size, uint32_t addr) override
+    {
+        memory->Read(data, size, addr);
+    }
+
+    void WriteMem(CPUState& state, uint32_t addr, void* data, size_t size) override
+    {
+        memory->Write(addr, data, size);
+    }
+
+    auto ReadIOByte(uint32_t addr) -> uint8_t override
+    {
+        return 0xFF;
+    }
+
+    auto ReadIOWord(uint32_t addr) -> uint16_t override
+    {
+        return 0xFFFF;
+    }
+
+    void WriteIOByte(uint32_t addr, uint8_t val) override
+    {}
+
+    void WriteIOWord(uint32_t addr, uint16_t val) override
+    {}
+
+    auto Direct(uint32_t addr, bool write) -> HostSpan override
+    {
+        return memory->Direct(addr, write);
+    }
+};
+
+SegmentReplay::SegmentReplay(std::shared_ptr<const Recording> recording, Machine machine, unsigned threads) :
+    recording(std::move(recording)),
+    machine(std::move(machine)),
+    pool(threads)
+{}
+
+void SegmentReplay::Prepare(uint64_t interval)
+{
+    checkpoints.clear();
+    base = std::make_unique<Memory>();
+    machine(*base);
+    Hook hook(*base);
+    Replayer replayer(hook, recording);
+    static_cast<MmioRanges&>(replayer) = *this;
+    CPU cpu(recording->initial, replayer);
+    while (true) {
+        while (!replayer.Finished() && (replayer.Pending(cpu) || (cpu.State().flags & TrapFlag))) {
+            replayer.Run(cpu, 1);
+        }
+        checkpoints.push_back(Capture(cpu, *base, replayer));
+        if (replayer.Finished()) {
+            break;
+        }
+        replayer.Run(cpu, (long long)interval);
+    }
+}
+
+auto SegmentReplay::Checkpoints() const -> const std::vector<Checkpoint>&
+{
+    return checkpoints;
+}
+
+auto SegmentReplay::Segments() const -> std::size_t
+{
+    return checkpoints.empty() ? 0 : checkpoints.size() - 1;
+}
+
+void SegmentReplay::Replay(std::size_t segment, const Analysis &analysis)
+{
+    auto& from = checkpoints.at(segment);
+    auto& to = checkpoints.at(segment + 1);
+    Memory memory;
+    machine(memory);
+    memory.Restore(*from.memory);
+    Hook hook(memory);
+    Replayer replayer(hook, recording);
+    static_cast<MmioRanges&>(replayer) = *this;
+    CPU cpu(from.state, replayer);
+    replayer.Seek(cpu, from.position);
+    analysis(segment, cpu, memory, replayer, (long long)(to.instructions - from.instructions));
+}
+
+void SegmentReplay::Analyse(const Analysis &analysis)
+{
+    std::mutex mutex;
+    std::exception_ptr error;
+    for (std::size_t segment = 0; segment < Segments(); ++segment) {
+        pool.Submit([this, segment, &analysis, &mutex, &error]{
+            try {
+                Replay(segment, analysis);
+            } catch (...) {
+                std::lock_guard lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        });
+    }
+    pool.Wait();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+auto SegmentReplay::Verify() -> std::vector<std::size_t>
+{
+    std::mutex mutex;
+    std::vector<std::size_t> failed;
+    for (std::size_t segment = 0; segment < Segments(); ++segment) {
+        pool.Submit([this, segment, &mutex, &failed]{
+            auto& to = checkpoints[segment + 1];
+            auto good = false;
+            try {
+                Replay(segment, [&](std::size_t, CPU& cpu, Memory& memory, Replayer& replayer, long long steps) {
+                    if (steps > 0) {
+                        replayer.Run(cpu, steps);
+                    }
+                    good = replayer.Tell(cpu).instructions == to.instructions && Hash(cpu.State(), memory) == to.hash;
+                });
+            } catch (...) {
+                good = false;
+            }
+            if (!good) {
+                std::lock_guard lock(mutex);
+                failed.push_back(segment);
+            }
+        });
+    }
+    pool.Wait();
+    std::sort(failed.begin(), failed.end());
+    return failed;
+}
+
+auto SegmentReplay::Capture(CPU &cpu, Memory &memory, Replayer &replayer) -> Checkpoint
+{
+    auto snapshot = std::make_shared<Memory::Snapshot>();
+    memory.Save(*snapshot);
+    auto position = replayer.Tell(cpu);
+    return { position.instructions, cpu.State(), position, std::move(snapshot), Hash(cpu.State(), memory) };
+}
+
+auto SegmentReplay::Hash(const CPUState &state, const Memory &memory) -> uint64_t
+{
+    uint64_t hash = 0xCBF29CE484222325;
+    HashBytes(hash, state.gpr, sizeof(state.gpr));
+    HashBytes(hash, &state.ip, sizeof(state.ip));
+    HashBytes(hash, &state.flags, sizeof(state.flags));
+    HashBytes(hash, state.sregs, sizeof(state.sregs));
+    uint8_t page[Memory::PageSize];
+    for (uint32_t addr = 0; addr < Memory::AddressSize; addr += Memory::PageSize) {
+        memory.Read(page, sizeof(page), addr);
+        HashBytes(hash, page, sizeof(page));
+    }
+    return hash;
+}
+
+} // namespace x86emu
@@ -0,0 +1,133 @@
+#include "include/cpu86e/threadpool.h"
+
+namespace cpu86e {
+
+namespace {
+
+thread_local ThreadPool* currentPool = nullptr;
+thread_local unsigned currentIndex = 0;
+
+}
+
+ThreadPool::ThreadPool(unsigned threads) :
+    queued(0),
+    pending(0),
+    next(0),
+    stop(false)
+{
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned i = 0; i < threads; ++i) {
+        workers.emplace_back(&ThreadPool::WorkerMain, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    Wait();
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::Submit(Task task)
+{
+    unsigned index;
+    if (currentPool == this) {
+        index = currentIndex;
+    } else {
+        index = next.fetch_add(1, std::memory_order_relaxed) % queues.size();
+    }
+    {
+        std::lock_guard lock(mutex);
+        ++pending;
+    }
+    {
+        auto& queue = *queues[index];
+        std::lock_guard lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        std::lock_guard lock(mutex);
+        queued.fetch_add(1, std::memory_order_release);
+    }
+    wake.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock lock(mutex);
+    idle.wait(lock, [this]{ return pending == 0; });
+}
+
+auto ThreadPool::Size() const -> unsigned
+{
+    return unsigned(workers.size());
+}
+
+bool ThreadPool::PopLocal(unsigned index, Task& task)
+{
+    auto& queue = *queues[index];
+    std::lock_guard lock(queue.mutex);
+    if (queue.tasks.empty()) {
+        return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    return true;
+}
+
+bool ThreadPool::Steal(unsigned index, Task& task)
+{
+    auto count = queues.size();
+    for (std::size_t i = 1; i < count; ++i) {
+        auto& queue = *queues[(index + i) % count];
+        std::lock_guard lock(queue.mutex);
+        if (!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::WorkerMain(unsigned index)
+{
+    currentPool = this;
+    currentIndex = index;
+    while (true) {
+        Task task;
+        if (PopLocal(index, task) || Steal(index, task)) {
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            task();
+            task = nullptr;
+            std::lock_guard lock(mutex);
+            if (--pending == 0) {
+                idle.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock lock(mutex);
+        wake.wait(lock, [this]{
+            return stop || queued.load(std::memory_order_acquire) > 0;
+        });
+        if (stop && queued.load(std::memory_order_acquire) <= 0) {
+            return;
+        }
+    }
+}
+
+} // namespace x86emu
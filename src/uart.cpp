@@ -0,0 +1,318 @@
+#include "include/cpu86e/uart.h"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace cpu86e {
+
+namespace {
+
+enum Identification {
+    NoInterrupt = 0x01,
+    HoldingInterrupt = 0x02,
+    DataInterrupt = 0x04,
+    FifoEnabled = 0xC0
+};
+
+constexpr uint8_t DivisorLatch = 0x80;
+constexpr uint8_t Loopback = 0x10;
+constexpr uint8_t ModemLines = 0xB0;
+constexpr auto FlushInterval = std::chrono::milliseconds(10);
+
+}
+
+Uart::Uart(int fd, std::size_t ring) :
+    fd(fd),
+    size(std::bit_ceil(std::max(ring, Fifo * 2))),
+    ring(std::make_unique<uint8_t[]>(size)),
+    head(0),
+    tail(0),
+    receive{},
+    received(0),
+    divisor(12),
+    enable(0),
+    lineControl(0x03),
+    modemControl(0),
+    scratch(0),
+    fifo(false),
+    holdingPending(false),
+    cpu(nullptr),
+    interrupt(CPU::NoInterrupt),
+    asserted(false),
+    flushing(false),
+    stop(false),
+    writes(0)
+{
+    worker = std::thread(&Uart::WorkerMain, this);
+}
+
+Uart::~Uart()
+{
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+auto Uart::ReadPort(uint32_t port) -> uint8_t
+{
+    switch (port) {
+    case Data: {
+        if (lineControl & DivisorLatch) {
+            return uint8_t(divisor);
+        }
+        std::lock_guard lock(registerMutex);
+        if (!received) {
+            return 0;
+        }
+        auto val = receive[0];
+        std::memmove(receive, receive + 1, --received);
+        Update();
+        return val;
+    }
+    case InterruptEnable:
+        return lineControl & DivisorLatch ? uint8_t(divisor >> 8) : enable;
+    case InterruptId: {
+        std::lock_guard lock(registerMutex);
+        auto id = Identify();
+        if (id == HoldingInterrupt) {
+            holdingPending = false;
+            Update();
+        }
+        return id | (fifo ? FifoEnabled : 0);
+    }
+    case LineControl:
+        return lineControl;
+    case ModemControl:
+        return modemControl;
+    case LineStatus: {
+        uint8_t val = 0;
+        {
+            std::lock_guard lock(registerMutex);
+            val |= received ? DataReady : 0;
+        }
+        auto queued = tail.load(std::memory_order_relaxed) - head.load(std::memory_order_acquire);
+        if (queued + Fifo <= size) {
+            val |= HoldingEmpty;
+        }
+        if (queued == 0) {
+            val |= TransmitterEmpty;
+        }
+        return val;
+    }
+    case ModemStatus:
+        return ModemLines;
+    case Scratch:
+        return scratch;
+    }
+    return 0xFF;
+}
+
+void Uart::WritePort(uint32_t port, uint8_t val)
+{
+    switch (port) {
+    case Data:
+        if (lineControl & DivisorLatch) {
+            divisor = uint16_t((divisor & 0xFF00) | val);
+        } else {
+            Transmit(val);
+        }
+        break;
+    case InterruptEnable:
+        if (lineControl & DivisorLatch) {
+            divisor = uint16_t((divisor & 0x00FF) | val << 8);
+            break;
+        }
+        {
+            std::lock_guard lock(registerMutex);
+            enable = val & 0x0F;
+            holdingPending = (enable & TransmitInterrupt) != 0;
+            Update();
+        }
+        break;
+    case InterruptId:
+        fifo = val & 1;
+        if (val & 2) {
+            std::lock_guard lock(registerMutex);
+            received = 0;
+            Update();
+        }
+        break;
+    case LineControl:
+        lineControl = val;
+        break;
+    case ModemControl: {
+        std::lock_guard lock(registerMutex);
+        modemControl = val & 0x1F;
+        Update();
+        break;
+    }
+    case Scratch:
+        scratch = val;
+        break;
+    }
+}
+
+auto Uart::Receive(const void *data, std::size_t size) -> std::size_t
+{
+    std::lock_guard lock(registerMutex);
+    auto n = std::min(size, Fifo - received);
+    std::memcpy(receive + received, data, n);
+    received += n;
+    Update();
+    return n;
+}
+
+void Uart::SetInterrupt(CPU &cpu, int interrupt)
+{
+    std::lock_guard lock(registerMutex);
+    if (this->cpu && asserted) {
+        this->cpu->SetINTR(CPU::NoInterrupt);
+    }
+    this->cpu = &cpu;
+    this->interrupt = interrupt;
+    asserted = false;
+    Update();
+}
+
+void Uart::Flush()
+{
+    std::unique_lock lock(mutex);
+    auto target = tail.load(std::memory_order_relaxed);
+    flushing = true;
+    wake.notify_one();
+    drained.wait(lock, [&] { return head.load(std::memory_order_relaxed) >= target; });
+    flushing = false;
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+auto Uart::Transmitted() const -> uint64_t
+{
+    return tail.load(std::memory_order_relaxed);
+}
+
+auto Uart::Writes() const -> uint64_t
+{
+    return writes.load(std::memory_order_relaxed);
+}
+
+void Uart::Transmit(uint8_t val)
+{
+    if (modemControl & Loopback) {
+        Receive(&val, 1);
+        return;
+    }
+    auto last = tail.load(std::memory_order_relaxed);
+    if (last - head.load(std::memory_order_acquire) >= size) {
+        std::unique_lock lock(mutex);
+        wake.notify_one();
+        drained.wait(lock, [&] { return last - head.load(std::memory_order_relaxed) < size; });
+    }
+    ring[last & (size - 1)] = val;
+    tail.store(last + 1, std::memory_order_release);
+    if (last + 1 - head.load(std::memory_order_relaxed) == size / 2) {
+        wake.notify_one();
+    }
+    std::lock_guard lock(registerMutex);
+    holdingPending = true;
+    Update();
+}
+
+auto Uart::Identify() -> uint8_t
+{
+    if ((enable & ReceiveInterrupt) && received) {
+        return DataInterrupt;
+    }
+    if ((enable & TransmitInterrupt) && holdingPending) {
+        return HoldingInterrupt;
+    }
+    return NoInterrupt;
+}
+
+void Uart::Update()
+{
+    if (!cpu) {
+        return;
+    }
+    if (Identify() != NoInterrupt) {
+        cpu->SetINTR(interrupt);
+        asserted = true;
+    } else if (asserted) {
+        cpu->SetINTR(CPU::NoInterrupt);
+        asserted = false;
+    }
+}
+
+void Uart::WorkerMain()
+{
+    while (true) {
+        bool last;
+        {
+            std::unique_lock lock(mutex);
+            wake.wait_for(lock, FlushInterval, [this] {
+                return stop || flushing || tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed) >= size / 2;
+            });
+            last = stop;
+        }
+        auto first = head.load(std::memory_order_relaxed);
+        auto end = tail.load(std::memory_order_acquire);
+        try {
+            while (first != end) {
+                auto offset = first & (size - 1);
+                auto n = std::min<uint64_t>(end - first, size - offset);
+                Write(ring.get() + offset, std::size_t(n));
+                first += n;
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        {
+            std::lock_guard lock(mutex);
+            head.store(end, std::memory_order_release);
+        }
+        drained.notify_all();
+        if (last) {
+            return;
+        }
+    }
+}
+
+void Uart::Write(const uint8_t *data, std::size_t size)
+{
+    if (error) {
+        return;
+    }
+    while (size) {
+#ifdef _WIN32
+        auto written = _write(fd, data, unsigned(std::min<std::size_t>(size, 1 << 30)));
+#else
+        auto written = write(fd, data, size);
+#endif
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            throw std::runtime_error("Can't write serial output");
+        }
+        writes.fetch_add(1, std::memory_order_relaxed);
+        data += written;
+        size -= std::size_t(written);
+    }
+}
+
+} // namespace x86emu